@@ -0,0 +1,348 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include "input_parser.h"
+
+#include "fast_math.h"
+#include "image.h"
+#include "image_io.h"
+#include "parallel.h"
+
+#include "display_models.h"
+
+/**
+ * @brief benchmarks of the steps of the hdr split pipeline on synthetic
+ *        frames. Each measure runs the step once to warm up the caches and
+ *        the intermediate buffers, then repeat times, and reports the minimum
+ *        and median times as one csv line or json object, so that results can
+ *        be compared from one release to the next.
+ */
+
+void output_usage()
+{
+  std::cout << "./hdr_bench <option> <values>" << std::endl;
+  std::cout << "  -sizes [size ...]             : frame sizes, 720p 1080p 1440p 4k 8k or WxH (optional)" << std::endl;
+  std::cout << "  -sigmas [sigma ...]           : gaussian psf parameters (optional)" << std::endl;
+  std::cout << "  -only [benchmark ...]         : benchmarks to run       (optional)" << std::endl;
+  std::cout << "  -repeat [count]               : timed runs per measure  (optional)" << std::endl;
+  std::cout << "  -threads [count]              : number of threads       (optional)" << std::endl;
+  std::cout << "  -format [csv|json]            : output format           (optional)" << std::endl;
+  std::cout << "  -o [filename]                 : output file, stdout by default (optional)" << std::endl;
+  std::cout << "  -tmp [directory]              : directory of the files written by the io benchmarks (optional)" << std::endl;
+  std::cout << "benchmarks : convolve convolve_image convolve_box psf_generate luma luminance write_image read_image process process_fused simulate" << std::endl;
+}
+
+/* measures **************************************************/
+
+/**
+ * @brief result of a benchmark, sigma is 0 for steps that do not depend on
+ *        the psf. The size is the one of the kernel for psf_generate
+ */
+struct Measure
+{
+  std::string name;
+  int width;
+  int height;
+  double sigma;
+  double min_ms;
+  double median_ms;
+};
+
+/**
+ * @brief writes the measures as csv lines or json objects, each measure is
+ *        written as soon as it is available
+ */
+class Report
+{
+public:
+  Report(std::ostream& out, bool json)
+  : m_out(out), m_json(json), m_count(0)
+  {
+    if(m_json)
+      m_out << "[" << std::endl;
+    else
+      m_out << "benchmark,width,height,sigma,threads,isa,min_ms,median_ms,mpixels_per_s" << std::endl;
+  }
+
+  ~Report()
+  {
+    if(m_json)
+      m_out << std::endl << "]" << std::endl;
+  }
+
+  void add(const Measure& measure)
+  {
+    double mpixels = measure.median_ms > 0. ? double(measure.width)*measure.height/(measure.median_ms*1e3) : 0.;
+
+    if(m_json){
+      m_out << (m_count > 0 ? ",\n" : "")
+            << "  { \"benchmark\": \"" << measure.name << "\""
+            << ", \"width\": " << measure.width
+            << ", \"height\": " << measure.height
+            << ", \"sigma\": " << measure.sigma
+            << ", \"threads\": " << thread_count()
+            << ", \"isa\": \"" << fast_math_isa() << "\""
+            << ", \"min_ms\": " << measure.min_ms
+            << ", \"median_ms\": " << measure.median_ms
+            << ", \"mpixels_per_s\": " << mpixels << " }";
+    }
+    else{
+      m_out << measure.name << "," << measure.width << "," << measure.height << "," << measure.sigma << ","
+            << thread_count() << "," << fast_math_isa() << "," << measure.min_ms << "," << measure.median_ms << "," << mpixels << std::endl;
+    }
+
+    m_out.flush();
+    ++m_count;
+  }
+
+private:
+  std::ostream& m_out;
+  bool m_json;
+  int m_count;
+};
+
+/**
+ * @brief times step, once to warm up then repeat times
+ */
+template<class Function>
+Measure measure(const std::string& name, int width, int height, double sigma, int repeat, const Function& step)
+{
+  std::cerr << name << " " << width << "x" << height;
+  if(sigma > 0.)
+    std::cerr << " sigma " << sigma;
+  std::cerr << std::endl;
+
+  step();
+
+  std::vector<double> times;
+  for(int r=0; r<repeat; ++r){
+    auto start = std::chrono::steady_clock::now();
+    step();
+    auto stop = std::chrono::steady_clock::now();
+
+    times.push_back(std::chrono::duration<double, std::milli>(stop - start).count());
+  }
+  std::sort(times.begin(), times.end());
+
+  Measure result;
+  result.name = name;
+  result.width = width;
+  result.height = height;
+  result.sigma = sigma;
+  result.min_ms = times.front();
+  result.median_ms = times[times.size()/2];
+  return result;
+}
+/*************************************************************/
+
+/**
+ * @brief parses a frame size, either a name or WxH
+ */
+bool parse_size(const std::string& size, int& width, int& height)
+{
+  if(size == "720p") { width = 1280; height = 720;  return true; }
+  if(size == "1080p"){ width = 1920; height = 1080; return true; }
+  if(size == "1440p"){ width = 2560; height = 1440; return true; }
+  if(size == "4k")   { width = 3840; height = 2160; return true; }
+  if(size == "8k")   { width = 7680; height = 4320; return true; }
+
+  char separator;
+  std::istringstream stream(size);
+  return (stream >> width >> separator >> height) && separator == 'x' && width > 0 && height > 0;
+}
+
+/**
+ * @brief synthetic hdr frame : smooth gradients spanning 5 orders of
+ *        magnitude, and small bright blocks that exercise the psf
+ */
+void synthetic_frame(Image& frame, int width, int height)
+{
+  frame.resize(height, width, 3);
+
+  parallel_for(width, [&](int i)
+  {
+    for(int j=0; j<height; ++j){
+      double x = double(i)/width, y = double(j)/height;
+      double base = std::pow(10., 4.*x*y - 2. + 0.5*std::sin(12.*x + 7.*y));
+      bool block = ((i/32) % 7 == 0) && ((j/32) % 5 == 0);
+
+      for(int c=0; c<3; ++c)
+        frame.data(i, j, c) = (block ? 50. : base) * (1. - 0.2*c*x);
+    }
+  });
+}
+
+int main(int argc, char** argv)
+{
+  InputParser parser(argc, argv);
+
+  if(parser.cmdOptionExists("-h") || parser.cmdOptionExists("-help")){
+    output_usage();
+    return 0;
+  }
+
+  InputParser::TokenList tokens;
+
+  //default parameters
+  std::vector<std::string> sizes{ "720p", "1080p", "4k", "8k" };
+  std::vector<double> sigmas{ 2., 8., 32., 128. };
+  std::vector<std::string> benchmarks{ "convolve", "convolve_image", "convolve_box", "psf_generate", "luma", "luminance",
+                                       "write_image", "read_image", "process", "process_fused", "simulate" };
+  int repeat = 5;
+  bool json = false;
+  std::string output, directory = ".";
+
+  //load parameter values if available
+  if(parser.getCmdOption("-sizes", tokens) > 0)
+    sizes = tokens;
+
+  if(parser.getCmdOption("-sigmas", tokens) > 0){
+    sigmas.clear();
+    for(size_t i=0; i<tokens.size(); ++i)
+      sigmas.push_back(std::atof(tokens[i].c_str()));
+  }
+
+  if(parser.getCmdOption("-only", tokens) > 0)
+    benchmarks = tokens;
+
+  if(parser.getCmdOption("-repeat", tokens) > 0)
+    repeat = std::max(1, std::atoi(tokens[0].c_str()));
+
+  if(parser.getCmdOption("-threads", tokens) > 0)
+    set_thread_count(std::atoi(tokens[0].c_str()));
+
+  if(parser.getCmdOption("-format", tokens) > 0){
+    if(tokens[0] == "json")
+      json = true;
+    else if(tokens[0] != "csv")
+      std::cerr << tokens[0] << " is not a valid format, using csv instead" << std::endl;
+  }
+
+  if(parser.getCmdOption("-o", tokens) > 0)
+    output = tokens[0];
+
+  if(parser.getCmdOption("-tmp", tokens) > 0)
+    directory = tokens[0];
+
+  auto enabled = [&](const std::string& name)
+  {
+    return std::find(benchmarks.begin(), benchmarks.end(), name) != benchmarks.end();
+  };
+
+  std::ofstream file;
+  if(!output.empty()){
+    file.open(output.c_str());
+    if(!file){
+      std::cerr << "unable to open " << output << std::endl;
+      return 1;
+    }
+  }
+
+  bool failure = false;
+  {
+    Report report(output.empty() ? std::cout : file, json);
+
+    DisplayResponse r_dlp(DRParams(5000., 5., 2.2));
+    DisplayResponse r_lcd(DRParams(1., 0.005, 2.2));
+
+    //the psf only depends on sigma
+    if(enabled("psf_generate")){
+      for(size_t s=0; s<sigmas.size(); ++s){
+        PSFParams p_psf(sigmas[s]);
+        PSF psf(p_psf);
+        Image kernel;
+        report.add(measure("psf_generate", p_psf.w, p_psf.h, sigmas[s], repeat, [&]{ psf.generate(kernel); }));
+      }
+    }
+
+    for(size_t f=0; f<sizes.size(); ++f){
+      int w, h;
+      if(!parse_size(sizes[f], w, h)){
+        std::cerr << sizes[f] << " is not a valid size" << std::endl;
+        failure = true;
+        continue;
+      }
+
+      Image frame, out1, out2;
+      synthetic_frame(frame, w, h);
+
+      //luma and luminance of a frame in [0, 1]
+      if(enabled("luma") || enabled("luminance")){
+        Image ldr(frame);
+        ldr.data() = ldr.data() / ldr.data().maxCoeff();
+
+        if(enabled("luma"))
+          report.add(measure("luma", w, h, 0., repeat, [&]{ r_dlp.luma(ldr, out1); }));
+        if(enabled("luminance"))
+          report.add(measure("luminance", w, h, 0., repeat, [&]{ r_dlp.luminance(ldr, out1); }));
+      }
+
+      //round trip through a pfm file
+      if(enabled("write_image") || enabled("read_image")){
+        std::string filename = directory + "/hdr_bench.pfm";
+
+        if(!write_image(frame, filename)){
+          std::cerr << "unable to save " << filename << std::endl;
+          failure = true;
+        }
+        else{
+          if(enabled("write_image"))
+            report.add(measure("write_image", w, h, 0., repeat, [&]{ write_image(frame, filename); }));
+          if(enabled("read_image"))
+            report.add(measure("read_image", w, h, 0., repeat, [&]{ read_image(out1, filename); }));
+          std::remove(filename.c_str());
+        }
+      }
+
+      for(size_t s=0; s<sigmas.size(); ++s){
+        PSFParams p_psf(sigmas[s]);
+        p_psf.c = frame.channel();
+        PSF psf(p_psf);
+
+        //the exact blur of the psf, as in process : separable path with the
+        //cached 1d factors
+        if(enabled("convolve"))
+          report.add(measure("convolve", w, h, sigmas[s], repeat, [&]{ psf.convolve(frame, out1); }));
+
+        //the generic direct / fft convolution with the full 2d kernel
+        if(enabled("convolve_image")){
+          const Image& kernel = psf.kernel();
+          report.add(measure("convolve_image", w, h, sigmas[s], repeat, [&]{ frame.convolve(kernel, out1); }));
+        }
+
+        if(enabled("convolve_box")){
+          PSF box_psf(p_psf);
+          box_psf.set_blur(BLUR_BOX, 3);
+          report.add(measure("convolve_box", w, h, sigmas[s], repeat, [&]{ box_psf.convolve(frame, out1); }));
+        }
+
+        ClosedFormDisplay hdr(HDRDisplayParams(&psf, &r_dlp, &r_lcd));
+        if(enabled("process"))
+          report.add(measure("process", w, h, sigmas[s], repeat, [&]{ hdr.process(frame, out1, out2); }));
+
+        //a display of its own, so that the other measures keep the default mode
+        if(enabled("process_fused")){
+          ClosedFormDisplay fused(HDRDisplayParams(&psf, &r_dlp, &r_lcd));
+          fused.set_fused(true);
+          report.add(measure("process_fused", w, h, sigmas[s], repeat, [&]{ fused.process(frame, out1, out2); }));
+        }
+
+        //simulation of the frame displayed for the outputs of process
+        if(enabled("simulate")){
+          hdr.process(frame, out1, out2);
+
+          Simulator simulator(HDRDisplayParams(&psf, &r_dlp, &r_lcd));
+          report.add(measure("simulate", w, h, sigmas[s], repeat, [&]{ simulator.simulate(frame, out1, out2); }));
+        }
+      }
+    }
+  }
+
+  return failure ? -1 : 0;
+}
@@ -0,0 +1,80 @@
+#ifndef DISPLAY_MODELS_H
+#define DISPLAY_MODELS_H
+
+#include <algorithm>
+
+#include "image.h"
+#include "psf.h"
+#include "display_response.h"
+#include "hdr_display.h"
+#include "display_simulator.h"
+
+/**
+ * @brief parameters and types of the models used by the hdr tool, shared with
+ *        the benchmark so that it measures the same configuration
+ */
+
+/* PSF Model *************************************************/
+struct PSFParams
+{
+ int h;
+ int w;
+ int c;
+ double sigma;
+
+ PSFParams(double pixels=8.)
+ : h(std::max(int(pixels), 1)), w(std::max(int(pixels), 1)), c(3), sigma(pixels)
+ {}
+
+ //the kernel is sigma pixels wide, and at least 1 pixel so that a sigma
+ //scaled below 1 (see -dlpres) does not give an empty kernel
+ void set_sigma(double pixels)
+ {
+   sigma = pixels;
+   h = std::max(int(pixels), 1);
+   w = std::max(int(pixels), 1);
+ }
+
+ bool operator==(const PSFParams& other) const
+ {
+   return h == other.h && w == other.w && c == other.c && sigma == other.sigma;
+ }
+};
+
+typedef GaussianPSF<Image, PSFParams> PSF;
+/*************************************************************/
+
+/* Display Response Model ************************************/
+struct DRParams
+{
+ double Lpeak;
+ double Lblack;
+ double gamma;
+
+ DRParams(double _Lpeak=1, double _Lbalck=0, double _gamma=2.2)
+ : Lpeak(_Lpeak), Lblack(_Lbalck), gamma(_gamma)
+ {}
+};
+
+typedef GainOffsetGamma<Image, DRParams> DisplayResponse;
+/*************************************************************/
+
+/* HDR Display Algorithm *************************************/
+struct HDRDisplayParams
+{
+ PSF* psf;
+ DisplayResponse* dlp_response;
+ DisplayResponse* lcd_response;
+
+ HDRDisplayParams(PSF* _psf=NULL, DisplayResponse* _dlp=NULL, DisplayResponse* _lcd=NULL)
+ : psf(_psf), dlp_response(_dlp), lcd_response(_lcd)
+ {}
+};
+
+typedef BaseHDRDisplay<Image, HDRDisplayParams> HDRDisplay;
+typedef ProjectorBasedDisplay<Image, HDRDisplayParams> ClosedFormDisplay;
+typedef IterativeProjectorDisplay<Image, HDRDisplayParams> IterativeDisplay;
+typedef DisplaySimulator<Image, HDRDisplayParams> Simulator;
+/**************************************************************/
+
+#endif //DISPLAY_MODELS_H
@@ -1,6 +1,13 @@
 #ifndef DISPLAY_RESPONSE_H
 #define DISPLAY_RESPONSE_H
 
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include "fast_math.h"
+
 /* base display response class ***************************************************/
 
 /**
@@ -14,6 +21,9 @@
  *        extend this class, implement the luminance() and luma() functions which
  *        correspond to the display response function and inverse display response
  *        functions respectively and define its conrresponding parameter class
+ *
+ *        version() is incremented on every change of the parameters or of
+ *        the evaluation, so that the users of the response can detect them.
  */
 template<class TImage, class TParam>
 class BaseDisplayResponse
@@ -24,20 +34,26 @@ public:
 
 public:
   BaseDisplayResponse()
-  : m_params(NULL)
+  : m_params(NULL), m_version(1)
   {}
 
   BaseDisplayResponse(const ParameterType& params)
-  : m_params(params)
+  : m_params(params), m_version(1)
   {}
 
   virtual ~BaseDisplayResponse()
   {}
 
 public:
-  inline void set_model_parameters(const ParameterType& params)
+  virtual void set_model_parameters(const ParameterType& params)
   {
     m_params = params;
+    ++m_version;
+  }
+
+  inline unsigned int version() const
+  {
+    return m_version;
   }
 
 public:
@@ -46,9 +62,26 @@ public:
 
 protected:
   ParameterType m_params;
+  unsigned int m_version;
 };
 
 
+/* evaluation modes of a display response model ***************************************************/
+
+/**
+ * @brief how a display response model evaluates its transfer functions:
+ *          - EVALUATION_EXACT : using std::pow (through Eigen)
+ *          - EVALUATION_FAST : using fast_pow() (see fast_math.h for the accuracy)
+ *          - EVALUATION_LUT : using lookup tables for outputs (luma) or inputs
+ *            (luminance) quantized to a given number of bits
+ */
+enum ResponseEvaluation
+{
+  EVALUATION_EXACT,
+  EVALUATION_FAST,
+  EVALUATION_LUT
+};
+
 /* GammaOffsetGain (GOG) display response model ***************************************************/
 
 /**
@@ -76,25 +109,186 @@ public:
   typedef typename SuperClass::ParameterType  ParameterType;
   typedef typename SuperClass::ImageType          ImageType;
 
+  typedef typename ImageType::Scalar Scalar;
+
 public:
-  GainOffsetGamma() : SuperClass(){}
-  GainOffsetGamma(ParameterType params) : SuperClass(params){}
+  GainOffsetGamma() : SuperClass(), m_evaluation(EVALUATION_EXACT), m_bits(8) {}
+  GainOffsetGamma(ParameterType params) : SuperClass(params), m_evaluation(EVALUATION_EXACT), m_bits(8) {}
 
   virtual ~GainOffsetGamma() {}
 
+public:
+  virtual void set_model_parameters(const ParameterType& params)
+  {
+    SuperClass::set_model_parameters(params);
+    update_tables();
+  }
+
+  /**
+   * @brief selects how luma() and luminance() are evaluated
+   * @param evaluation is the evaluation mode
+   * @param bits is the number of bits of the quantized values (EVALUATION_LUT
+   *        only) : luma() returns k/(2^bits-1) with k the nearest level of the
+   *        exact result, luminance() rounds its input to the nearest level.
+   *        It is clamped to [1, 16].
+   */
+  void set_evaluation(ResponseEvaluation evaluation, int bits=8)
+  {
+    m_evaluation = evaluation;
+    m_bits = std::min(std::max(bits, 1), 16);
+    ++this->m_version;
+    update_tables();
+  }
+
+  inline ResponseEvaluation evaluation() const
+  {
+    return m_evaluation;
+  }
+
+  inline int bits() const
+  {
+    return m_bits;
+  }
+
 public:
   virtual void luminance(const ImageType& in, ImageType& out) const
   {
-    out.data() = (this->m_params.Lpeak - this->m_params.Lblack) * in.data().pow(this->m_params.gamma) + this->m_params.Lblack;
+    Scalar range = Scalar(this->m_params.Lpeak - this->m_params.Lblack);
+    Scalar black = Scalar(this->m_params.Lblack);
+
+    out.resize(in.height(), in.width(), in.channel());
+
+    switch(m_evaluation){
+    case EVALUATION_EXACT:
+      out.data() = range * in.data().pow(Scalar(this->m_params.gamma)) + black;
+      break;
+
+    case EVALUATION_FAST:
+      for_each_block(in, out, [&](const Scalar* src, Scalar* dst, int n)
+      {
+        fast_pow(src, dst, n, Scalar(this->m_params.gamma));
+      });
+      out.data() = range * out.data() + black;
+      break;
+
+    case EVALUATION_LUT:
+    {
+      int levels = int(m_luminance_table.size()) - 1;
+
+      for_each_block(in, out, [&](const Scalar* src, Scalar* dst, int n)
+      {
+        for(int k=0; k<n; ++k){
+          Scalar level = std::min(std::max(src[k], Scalar(0)), Scalar(1)) * Scalar(levels);
+          dst[k] = m_luminance_table[int(level + Scalar(0.5))];
+        }
+      });
+      break;
+    }
+    }
   }
 
+  /**
+   * @brief luminances below Lblack give 0 and luminances above Lpeak give 1,
+   *        in every evaluation mode. Releases before the evaluation modes did
+   *        not clamp : luma() returned NaN below Lblack and values above 1
+   *        above Lpeak.
+   */
   virtual void luma(const ImageType& in, ImageType& out) const
   {
-    out.data() = ((in.data() - this->m_params.Lblack) / (this->m_params.Lpeak-this->m_params.Lblack)).pow(1./this->m_params.gamma);
+    Scalar range = Scalar(this->m_params.Lpeak - this->m_params.Lblack);
+    Scalar black = Scalar(this->m_params.Lblack);
+
+    out.resize(in.height(), in.width(), in.channel());
+
+    switch(m_evaluation){
+    case EVALUATION_EXACT:
+      //clamp values between 0 and 1
+      out.data() = ((in.data() - black) / range).max(Scalar(0)).min(Scalar(1)).pow(Scalar(1./this->m_params.gamma));
+      break;
 
-    //clamp values between 0 and 1
-    out.data().min(0.).max(1.);
+    case EVALUATION_FAST:
+      out.data() = ((in.data() - black) / range).max(Scalar(0)).min(Scalar(1));
+      for_each_block(out, out, [&](const Scalar* src, Scalar* dst, int n)
+      {
+        fast_pow(src, dst, n, Scalar(1./this->m_params.gamma));
+      });
+      break;
+
+    case EVALUATION_LUT:
+    {
+      //branchless binary search of the last threshold below the input, the
+      //table has a power of two size and starts with -infinity
+      int size = int(m_luma_thresholds.size());
+      Scalar scale = Scalar(1)/Scalar(size-1);
+
+      for_each_block(in, out, [&](const Scalar* src, Scalar* dst, int n)
+      {
+        for(int k=0; k<n; ++k){
+          int level = 0;
+          for(int step=size/2; step>0; step/=2)
+            level += (m_luma_thresholds[level+step] <= src[k]) ? step : 0;
+
+          dst[k] = Scalar(level) * scale;
+        }
+      });
+      break;
+    }
+    }
   }
+
+protected:
+  /**
+   * @brief calls operation(src, dst, n) on the contiguous blocks of values of
+   *        in and out : the whole data, or each channel (PLANAR) or pixel
+   *        (INTERLEAVED) when one of them is a view with a stride
+   */
+  template<class TOperation>
+  static void for_each_block(const ImageType& in, ImageType& out, TOperation operation)
+  {
+    if(in.is_contiguous() && out.is_contiguous()){
+      operation(in.data().data(), out.data().data(), int(in.data().size()));
+      return;
+    }
+
+    for(int k=0; k<int(in.data().outerSize()); ++k)
+      operation(in.data().data()  + k*in.data().outerStride(),
+                out.data().data() + k*out.data().outerStride(), int(in.data().innerSize()));
+  }
+
+  /**
+   * @brief computes the lookup tables used by EVALUATION_LUT
+   */
+  void update_tables()
+  {
+    m_luma_thresholds.clear();
+    m_luminance_table.clear();
+
+    if(m_evaluation != EVALUATION_LUT)
+      return;
+
+    double Lpeak = this->m_params.Lpeak, Lblack = this->m_params.Lblack;
+    double gamma = this->m_params.gamma;
+    int levels = (1 << m_bits) - 1;
+
+    //luma() returns level k when its input is above the luminance of the
+    //value halfway between levels k-1 and k
+    m_luma_thresholds.resize(levels+1);
+    m_luma_thresholds[0] = -std::numeric_limits<Scalar>::infinity();
+    for(int k=1; k<=levels; ++k)
+      m_luma_thresholds[k] = Scalar((Lpeak - Lblack) * std::pow((k - 0.5)/levels, gamma) + Lblack);
+
+    //luminance() of every level
+    m_luminance_table.resize(levels+1);
+    for(int k=0; k<=levels; ++k)
+      m_luminance_table[k] = Scalar((Lpeak - Lblack) * std::pow(double(k)/levels, gamma) + Lblack);
+  }
+
+protected:
+  ResponseEvaluation m_evaluation;
+  int m_bits;
+
+  std::vector<Scalar> m_luma_thresholds;
+  std::vector<Scalar> m_luminance_table;
 };
 
 #endif //DISPLAY_RESPONSE_H
@@ -0,0 +1,163 @@
+#ifndef DISPLAY_SIMULATOR_H
+#define DISPLAY_SIMULATOR_H
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <ostream>
+
+/* simulation statistics ****************************************************************/
+
+/**
+ * @brief accuracy of a reconstructed frame, see DisplaySimulator::compare()
+ */
+struct SimulationStats
+{
+  //peak signal to noise ratio in dB, the peak being the maximum of the target.
+  //infinite for an exact reconstruction, nan if the images contain nan
+  double psnr;
+
+  //absolute log10 ratio between the reconstruction and the target
+  double log_error_mean;
+  double log_error_rms;
+  double log_error_max;
+
+  SimulationStats()
+  : psnr(0.), log_error_mean(0.), log_error_rms(0.), log_error_max(0.)
+  {}
+
+  void print(std::ostream& out) const
+  {
+    out << "psnr " << psnr << "dB, log10 error mean " << log_error_mean
+        << ", rms " << log_error_rms << ", max " << log_error_max;
+  }
+};
+
+/* display simulator class ***************************************************************/
+
+/**
+ *`@brief forward model of the dual modulation display : computes the
+ *        luminance seen by the viewer from the dlp and lcd images given by
+ *        an HDR display algorithm (see BaseHDRDisplay), as
+ *          convolution(psf, luminance(dlp)) * luminance(lcd)
+ *
+ *        takes two types as template:
+ *          - TImage is the desired generated image type
+ *          - TPram is a type capable of handeling the model parameters, the
+ *            same as the one of the HDR display algorithms : psf,
+ *            dlp_response and lcd_response
+ *
+ *        the dlp image may have a lower resolution than the lcd one (see
+ *        ProjectorBasedDisplay::set_backlight_resolution()), the psf being
+ *        then expressed in pixels of the dlp : the blurred backlight is
+ *        interpolated to the resolution of the lcd by ImageT::resample().
+ *
+ *        the psf is applied with BasePSF::convolve(), according to its blur
+ *        mode, so the cost of a simulation is about the one of the algorithm.
+ *        The intermediate images are kept between frames, and the psf caches
+ *        are not thread safe : to validate frames while the next ones are
+ *        processed, give the simulator its own psf instance.
+ */
+template <class TImage, class TParams>
+class DisplaySimulator
+{
+public:
+  typedef TImage      ImageType;
+  typedef TParams ParameterType;
+
+  typedef typename ImageType::Scalar Scalar;
+
+public:
+  DisplaySimulator() {}
+  DisplaySimulator(const ParameterType& params)
+  : m_params(params)
+  {}
+
+  virtual ~DisplaySimulator() {}
+
+  void set_model_parameters(const ParameterType& params)
+  {
+    m_params = params;
+  }
+
+public:
+  /**
+   * @brief computes the luminance displayed for the dlp and lcd images
+   *        (values in [0, 1])
+   */
+  void reconstruct(const ImageType& dlp, const ImageType& lcd, ImageType& out) const
+  {
+    m_params.dlp_response->luminance(dlp, m_dlp);
+    if(dlp.height() == lcd.height() && dlp.width() == lcd.width())
+      m_params.psf->convolve(m_dlp, m_backlight);
+    else{
+      m_params.psf->convolve(m_dlp, m_blurred);
+      m_blurred.resample(lcd.height(), lcd.width(), m_backlight);
+    }
+
+    m_params.lcd_response->luminance(lcd, out);
+    out.data() *= m_backlight.data();
+  }
+
+  /**
+   * @brief compares a reconstruction with its target luminance
+   * @param error receives log10(reconstruction/target). Both images are
+   *        clamped to 1e-6 times the maximum of the target, so that the log
+   *        error ignores the differences in the blacks that no display
+   *        reproduces
+   */
+  static SimulationStats compare(const ImageType& target, const ImageType& reconstruction, ImageType& error)
+  {
+    SimulationStats stats;
+    if(target.data().size() == 0)
+      return stats;
+
+    double peak = double(target.data().maxCoeff());
+    double mse  = double((reconstruction.data() - target.data()).square().mean());
+    stats.psnr = mse == 0. ? std::numeric_limits<double>::infinity() : 10.*std::log10(peak*peak/mse);
+
+    Scalar floor = Scalar(1e-6*peak);
+    if(!(floor > Scalar(0)))
+      floor = std::numeric_limits<Scalar>::min();
+
+    error.resize(target.height(), target.width(), target.channel());
+    error.data() = (reconstruction.data().max(floor) / target.data().max(floor)).log10();
+
+    stats.log_error_mean = double(error.data().abs().mean());
+    stats.log_error_rms  = std::sqrt(double(error.data().square().mean()));
+    stats.log_error_max  = double(error.data().abs().maxCoeff());
+    return stats;
+  }
+
+  /**
+   * @brief reconstructs the frame displayed for target and compares them,
+   *        the images are available through reconstruction() and error()
+   */
+  SimulationStats simulate(const ImageType& target, const ImageType& dlp, const ImageType& lcd) const
+  {
+    reconstruct(dlp, lcd, m_reconstruction);
+    return compare(target, m_reconstruction, m_error);
+  }
+
+  /**
+   * @brief images of the last call to simulate()
+   */
+  inline const ImageType& reconstruction() const
+  {
+    return m_reconstruction;
+  }
+
+  inline const ImageType& error() const
+  {
+    return m_error;
+  }
+
+protected:
+  ParameterType m_params;
+
+  //intermediate images, kept between frames
+  mutable ImageType m_dlp, m_blurred, m_backlight;
+  mutable ImageType m_reconstruction, m_error;
+};
+
+#endif //DISPLAY_SIMULATOR_H
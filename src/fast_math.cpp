@@ -0,0 +1,230 @@
+#include "fast_math.h"
+
+#include <algorithm>
+
+//with gcc and clang on x86, the simd versions are compiled for their
+//instruction set whatever the target of the build, and selected at run time.
+//Otherwise only the instruction set targeted by the compiler is available
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define FAST_MATH_DISPATCH
+#define FAST_MATH_AVX512 1
+#define FAST_MATH_AVX2   1
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+#define TARGET_AVX2   __attribute__((target("avx2")))
+#else
+#if defined(__AVX512F__)
+#define FAST_MATH_AVX512 1
+#define FAST_MATH_AVX2   0
+#elif defined(__AVX2__)
+#define FAST_MATH_AVX512 0
+#define FAST_MATH_AVX2   1
+#else
+#define FAST_MATH_AVX512 0
+#define FAST_MATH_AVX2   0
+#endif
+#define TARGET_AVX512
+#define TARGET_AVX2
+#endif
+
+#if FAST_MATH_AVX512 || FAST_MATH_AVX2
+#include <immintrin.h>
+#endif
+
+/* AVX-512 ********************************************************************/
+#if FAST_MATH_AVX512
+
+TARGET_AVX512 static inline __m512 fast_log2_avx512(__m512 x)
+{
+  __m512i bits = _mm512_castps_si512(x);
+
+  __m512 e = _mm512_cvtepi32_ps(_mm512_sub_epi32(_mm512_srli_epi32(bits, 23), _mm512_set1_epi32(127)));
+  __m512 m = _mm512_castsi512_ps(_mm512_or_si512(_mm512_and_si512(bits, _mm512_set1_epi32(0x007fffff)),
+                                                 _mm512_set1_epi32(0x3f800000)));
+
+  __mmask16 big = _mm512_cmp_ps_mask(m, _mm512_set1_ps(SQRT2), _CMP_GT_OQ);
+  m = _mm512_mask_mul_ps(m, big, m, _mm512_set1_ps(0.5f));
+  e = _mm512_mask_add_ps(e, big, e, _mm512_set1_ps(1.f));
+
+  __m512 one = _mm512_set1_ps(1.f);
+  __m512 t   = _mm512_div_ps(_mm512_sub_ps(m, one), _mm512_add_ps(m, one));
+  __m512 t2  = _mm512_mul_ps(t, t);
+
+  __m512 p = _mm512_set1_ps(LOG2_SERIES[0]);
+  for(int k=1; k<5; ++k)
+    p = _mm512_add_ps(_mm512_mul_ps(p, t2), _mm512_set1_ps(LOG2_SERIES[k]));
+
+  return _mm512_add_ps(e, _mm512_mul_ps(p, t));
+}
+
+TARGET_AVX512 static inline __m512 fast_exp2_avx512(__m512 x)
+{
+  x = _mm512_max_ps(x, _mm512_set1_ps(-126.f));
+  x = _mm512_min_ps(x, _mm512_set1_ps( 127.f));
+
+  //round half away from zero, as the scalar version
+  __mmask16 negative = _mm512_cmp_ps_mask(x, _mm512_setzero_ps(), _CMP_LT_OQ);
+  __m512 half = _mm512_mask_blend_ps(negative, _mm512_set1_ps(0.5f), _mm512_set1_ps(-0.5f));
+  __m512i n   = _mm512_cvttps_epi32(_mm512_add_ps(x, half));
+
+  __m512 g = _mm512_mul_ps(_mm512_sub_ps(x, _mm512_cvtepi32_ps(n)), _mm512_set1_ps(LN2));
+
+  __m512 p = _mm512_set1_ps(EXP_SERIES[0]);
+  for(int k=1; k<8; ++k)
+    p = _mm512_add_ps(_mm512_mul_ps(p, g), _mm512_set1_ps(EXP_SERIES[k]));
+
+  __m512 scale = _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_add_epi32(n, _mm512_set1_epi32(127)), 23));
+  return _mm512_mul_ps(p, scale);
+}
+
+TARGET_AVX512 static int fast_pow_avx512(const float* in, float* out, int n, float exponent)
+{
+  __m512 y = _mm512_set1_ps(exponent);
+
+  int i = 0;
+  for(; i+16<=n; i+=16){
+    __m512 x = _mm512_loadu_ps(in + i);
+    __mmask16 positive = _mm512_cmp_ps_mask(x, _mm512_setzero_ps(), _CMP_GT_OQ);
+
+    __m512 r = fast_exp2_avx512(_mm512_mul_ps(y, fast_log2_avx512(x)));
+    _mm512_storeu_ps(out + i, _mm512_maskz_mov_ps(positive, r));
+  }
+
+  return i;
+}
+
+#endif
+
+/* AVX2 ***********************************************************************/
+#if FAST_MATH_AVX2
+
+TARGET_AVX2 static inline __m256 fast_log2_avx2(__m256 x)
+{
+  __m256i bits = _mm256_castps_si256(x);
+
+  __m256 e = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(127)));
+  __m256 m = _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x007fffff)),
+                                                 _mm256_set1_epi32(0x3f800000)));
+
+  __m256 one = _mm256_set1_ps(1.f);
+  __m256 big = _mm256_cmp_ps(m, _mm256_set1_ps(SQRT2), _CMP_GT_OQ);
+  m = _mm256_blendv_ps(m, _mm256_mul_ps(m, _mm256_set1_ps(0.5f)), big);
+  e = _mm256_blendv_ps(e, _mm256_add_ps(e, one), big);
+
+  __m256 t  = _mm256_div_ps(_mm256_sub_ps(m, one), _mm256_add_ps(m, one));
+  __m256 t2 = _mm256_mul_ps(t, t);
+
+  __m256 p = _mm256_set1_ps(LOG2_SERIES[0]);
+  for(int k=1; k<5; ++k)
+    p = _mm256_add_ps(_mm256_mul_ps(p, t2), _mm256_set1_ps(LOG2_SERIES[k]));
+
+  return _mm256_add_ps(e, _mm256_mul_ps(p, t));
+}
+
+TARGET_AVX2 static inline __m256 fast_exp2_avx2(__m256 x)
+{
+  x = _mm256_max_ps(x, _mm256_set1_ps(-126.f));
+  x = _mm256_min_ps(x, _mm256_set1_ps( 127.f));
+
+  //round half away from zero, as the scalar version
+  __m256 negative = _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_LT_OQ);
+  __m256 half     = _mm256_blendv_ps(_mm256_set1_ps(0.5f), _mm256_set1_ps(-0.5f), negative);
+  __m256i n       = _mm256_cvttps_epi32(_mm256_add_ps(x, half));
+
+  __m256 g = _mm256_mul_ps(_mm256_sub_ps(x, _mm256_cvtepi32_ps(n)), _mm256_set1_ps(LN2));
+
+  __m256 p = _mm256_set1_ps(EXP_SERIES[0]);
+  for(int k=1; k<8; ++k)
+    p = _mm256_add_ps(_mm256_mul_ps(p, g), _mm256_set1_ps(EXP_SERIES[k]));
+
+  __m256 scale = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(n, _mm256_set1_epi32(127)), 23));
+  return _mm256_mul_ps(p, scale);
+}
+
+TARGET_AVX2 static int fast_pow_avx2(const float* in, float* out, int n, float exponent)
+{
+  __m256 y = _mm256_set1_ps(exponent);
+
+  int i = 0;
+  for(; i+8<=n; i+=8){
+    __m256 x = _mm256_loadu_ps(in + i);
+    __m256 positive = _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_GT_OQ);
+
+    __m256 r = fast_exp2_avx2(_mm256_mul_ps(y, fast_log2_avx2(x)));
+    _mm256_storeu_ps(out + i, _mm256_and_ps(r, positive));
+  }
+
+  return i;
+}
+
+#endif
+
+/* scalar fallback ************************************************************/
+
+static int fast_pow_none(const float*, float*, int, float)
+{
+  return 0;
+}
+
+/* dispatch *******************************************************************/
+
+typedef int (*FastPowSIMD)(const float* in, float* out, int n, float exponent);
+
+struct FastPowVersion
+{
+  FastPowSIMD function;
+  const char* isa;
+};
+
+static FastPowVersion select_version()
+{
+#if defined(FAST_MATH_DISPATCH)
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx512f"))
+    return FastPowVersion{ &fast_pow_avx512, "avx512" };
+  if(__builtin_cpu_supports("avx2"))
+    return FastPowVersion{ &fast_pow_avx2, "avx2" };
+#elif FAST_MATH_AVX512
+  return FastPowVersion{ &fast_pow_avx512, "avx512" };
+#elif FAST_MATH_AVX2
+  return FastPowVersion{ &fast_pow_avx2, "avx2" };
+#endif
+  return FastPowVersion{ &fast_pow_none, "scalar" };
+}
+
+static const FastPowVersion& fast_pow_version()
+{
+  static const FastPowVersion version = select_version();
+  return version;
+}
+
+const char* fast_math_isa()
+{
+  return fast_pow_version().isa;
+}
+
+/* array versions *************************************************************/
+
+void fast_pow(const float* in, float* out, int n, float exponent)
+{
+  //the simd version processes the largest multiple of its width
+  for(int i=fast_pow_version().function(in, out, n, exponent); i<n; ++i)
+    out[i] = fast_pow(in[i], exponent);
+}
+
+void fast_pow(const double* in, double* out, int n, double exponent)
+{
+  const int block = 256;
+  float buffer[block];
+
+  for(int i=0; i<n; i+=block){
+    int size = std::min(block, n-i);
+
+    for(int k=0; k<size; ++k)
+      buffer[k] = float(in[i+k]);
+
+    fast_pow(buffer, buffer, size, float(exponent));
+
+    for(int k=0; k<size; ++k)
+      out[i+k] = double(buffer[k]);
+  }
+}
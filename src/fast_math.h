@@ -0,0 +1,135 @@
+#ifndef FAST_MATH_H
+#define FAST_MATH_H
+
+#include <cstring>
+#include <stdint.h>
+
+/**
+ * @brief Approximations of log2, exp2 and pow in single precision.
+ *
+ *        log2 uses the exponent of the float and the atanh series of the
+ *        mantissa in [sqrt(2)/2, sqrt(2)], exp2 uses a degree 7 polynomial on
+ *        [-0.5, 0.5] and sets the exponent bits directly.
+ *
+ *        Accuracy (measured against std::log2, std::exp2 and std::pow in
+ *        double precision, on every float of the ranges for log2 and on a
+ *        grid of exponents with a step of 0.01 for pow) :
+ *          - fast_log2 : absolute error below 2.1e-7 for x in [0.1, 1], below
+ *                        1.1e-6 for x in [1e-6, 1] and below 4e-6 for all
+ *                        normal floats, relative error below 1e-7 when
+ *                        |log2(x)| > 1. The exponent of x is added to the
+ *                        series in float, the absolute error is the one of
+ *                        the rounding of the result.
+ *          - fast_exp2 : relative error below 1.1e-7 on [-126, 127]
+ *          - fast_pow  : relative error below 2.9e-6 for x in [1e-3, 1] and
+ *                        below 5.5e-6 for x in [1e-6, 1], with exponents in
+ *                        [1/4, 4]. The error comes from the rounding of
+ *                        exponent*log2(x) and grows with it.
+ *
+ *        Inputs must be normal positive floats, except that fast_pow returns 0
+ *        for x <= 0. The exponent of the results is clamped to [-126, 127].
+ *
+ *        The array versions use AVX-512 or AVX2 when the processor supports
+ *        them (checked at run time with gcc and clang on x86, otherwise when
+ *        the compiler targets them) and fall back to the scalar code
+ *        otherwise. All versions perform the same operations, so they return
+ *        the same values (fast_math.cpp is compiled without fma
+ *        contraction, the inline functions may round differently in
+ *        translation units that contract).
+ */
+
+/* polynomial coefficients, shared by all versions ****************************/
+
+//2/(k ln2) for k = 9, 7, 5, 3, 1
+static const float LOG2_SERIES[5] = { 0.32059890f, 0.41219858f, 0.57707802f,
+                                      0.96179669f, 2.88539008f };
+
+//1/k! for k = 7 to 0
+static const float EXP_SERIES[8] = { 1.98412698e-4f, 1.38888889e-3f, 8.33333333e-3f,
+                                     4.16666667e-2f, 1.66666667e-1f, 0.5f, 1.f, 1.f };
+
+static const float SQRT2 = 1.41421356f;
+static const float LN2   = 0.69314718f;
+
+/* scalar versions ************************************************************/
+
+inline float fast_log2(float x)
+{
+  int32_t bits;
+  std::memcpy(&bits, &x, sizeof(float));
+
+  //x = 2^e * m with m in [1, 2)
+  float e = float((bits >> 23) - 127);
+  bits = (bits & 0x007fffff) | 0x3f800000;
+
+  float m;
+  std::memcpy(&m, &bits, sizeof(float));
+
+  //m in [sqrt(2)/2, sqrt(2)]
+  if(m > SQRT2){
+    m *= 0.5f;
+    e += 1.f;
+  }
+
+  //log2(m) = 2/ln(2) * atanh(t), t = (m-1)/(m+1)
+  float t  = (m - 1.f)/(m + 1.f);
+  float t2 = t*t;
+
+  float p = LOG2_SERIES[0];
+  for(int k=1; k<5; ++k)
+    p = p*t2 + LOG2_SERIES[k];
+
+  return e + p*t;
+}
+
+inline float fast_exp2(float x)
+{
+  if(x < -126.f)
+    x = -126.f;
+  if(x > 127.f)
+    x = 127.f;
+
+  //2^x = 2^n * e^(f ln2), f in [-0.5, 0.5]
+  float n = float(int(x + (x < 0.f ? -0.5f : 0.5f)));
+  float g = (x - n)*LN2;
+
+  float p = EXP_SERIES[0];
+  for(int k=1; k<8; ++k)
+    p = p*g + EXP_SERIES[k];
+
+  int32_t bits = (int32_t(n) + 127) << 23;
+  float scale;
+  std::memcpy(&scale, &bits, sizeof(float));
+
+  return p*scale;
+}
+
+inline float fast_pow(float x, float exponent)
+{
+  if(!(x > 0.f))
+    return 0.f;
+
+  return fast_exp2(exponent*fast_log2(x));
+}
+
+/* array versions *************************************************************/
+
+/**
+ * @brief instruction set used by the array versions : "avx512", "avx2" or
+ *        "scalar"
+ */
+const char* fast_math_isa();
+
+/**
+ * @brief computes out[i] = fast_pow(in[i], exponent) for i in [0, n).
+ *        in and out may be the same array.
+ */
+void fast_pow(const float* in, float* out, int n, float exponent);
+
+/**
+ * @brief double precision interface, values are converted to float so the
+ *        accuracy is the one of the float version.
+ */
+void fast_pow(const double* in, double* out, int n, double exponent);
+
+#endif //FAST_MATH_H
@@ -0,0 +1,127 @@
+#ifndef FFT_CONVOLUTION_H
+#define FFT_CONVOLUTION_H
+
+#include <complex>
+#include <vector>
+
+#include "image.h"
+
+/**
+ * @brief Minimal radix-2 complex FFT of a fixed size (a power of two).
+ *        Twiddle factors and the bit reversal permutation are precomputed
+ *        once, so that the same plan can be applied to many signals.
+ */
+class FFTPlan
+{
+public:
+  typedef std::complex<double> Complex;
+
+public:
+  FFTPlan();
+  FFTPlan(int size);
+  virtual ~FFTPlan();
+
+  inline int size() const
+  {
+    return m_size;
+  }
+
+  /**
+   * @brief in place transform of size() contiguous values
+   * @param inverse computes the inverse transform (scaled by 1/size()) if true
+   */
+  void transform(Complex* data, bool inverse=false) const;
+
+  /**
+   * @brief returns the smallest power of two greater or equal to n
+   */
+  static int next_size(int n);
+
+private:
+  int m_size;
+  std::vector<int>     m_reverse;
+  std::vector<Complex> m_twiddle;
+};
+
+/**
+ * @brief frequency domain implementation of Image::convolve.
+ *        The input is padded with the border condition (mirror by default) by
+ *        half the kernel size, so the result matches the direct convolution up to
+ *        rounding errors.
+ *
+ *        The spectrum of the last kernel is kept, it is only recomputed when
+ *        the kernel values or the image size change. Using one instance per
+ *        frame sequence therefore transforms the kernel only once. Channels
+ *        with the same kernel share their spectrum, and as the kernel is real
+ *        only half of it is stored (the other half is its conjugate).
+ */
+class FFTConvolution
+{
+public:
+  typedef FFTPlan::Complex Complex;
+
+public:
+  FFTConvolution();
+  virtual ~FFTConvolution();
+
+  /**
+   * @brief performes a convolution operation with kernel.
+   *        Computations are done in double precision for all image types.
+   * @param in is the image to convolve
+   * @param kernel is the convolution kernel, with as many channels as in
+   * @param out is the resuting image
+   * @param border is the border condition used to pad the input
+   */
+  template<class TImage>
+  void convolve(const TImage& in, const TImage& kernel, TImage& out, BorderMode border=BORDER_MIRROR);
+
+  /**
+   * @brief rough cost model used by Image::convolve to pick a backend.
+   * @return true if the fft convolution is expected to be faster than the
+   *         direct one for the given image and kernel sizes.
+   */
+  static bool is_faster(int height, int width, int kernel_height, int kernel_width);
+
+private:
+  /**
+   * @brief prepares the plans and the kernel spectra for a given image size,
+   *        does nothing if neither the size nor the kernel changed.
+   */
+  template<class TImage>
+  void update(const TImage& kernel, int height, int width);
+
+  /**
+   * @brief 2d transforms, only the first rows of the input are non zero
+   *        (forward) or needed in the output (inverse).
+   */
+  void forward(std::vector<Complex>& buffer, int rows) const;
+  void inverse(std::vector<Complex>& buffer, int rows) const;
+
+  /**
+   * @brief transforms every column of buffer and writes back its first rows
+   */
+  void transform_columns(std::vector<Complex>& buffer, int rows, bool inverse) const;
+
+private:
+  /* image and padded sizes ***************************************************/
+  int m_height;
+  int m_width;
+
+  FFTPlan m_plan_y;
+  FFTPlan m_plan_x;
+
+  /* cached kernel ************************************************************/
+  int m_kernel_height;
+  int m_kernel_width;
+  Eigen::ArrayXXd m_kernel;
+
+  //spectra of the distinct kernel channels, rows [0, n_x/2] of the 2d
+  //transform, and spectrum used by each channel
+  std::vector< std::vector<Complex> > m_spectrum;
+  std::vector<int> m_spectrum_index;
+
+  /* scratch buffer ***********************************************************/
+  std::vector<Complex> m_buffer;
+};
+
+#endif //FFT_CONVOLUTION_H
@@ -1,6 +1,84 @@
 #ifndef HDR_DISPLAY_H
 #define HDR_DISPLAY_H
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <ostream>
+#include <vector>
+
+#include "parallel.h"
+#include "psf.h"
+#include "quantized_image.h"
+
+/* process statistics *******************************************************************/
+
+/**
+ * @brief statistics of a call to process(), see BaseHDRDisplay::set_stats().
+ *        Stages that an algorithm does not have keep a time of 0. When the
+ *        stages run concurrently (fused mode), their times are the sums of
+ *        the times spent by each thread, and may exceed total_ms. The
+ *        quantization of the outputs (see the quantized process()) is part
+ *        of the dlp and lcd stages, except in fused mode.
+ */
+struct ProcessStats
+{
+  //time of each stage, in milliseconds
+  double sqrt_ms;
+  double blur_ms;
+  double divide_ms;
+  double dlp_ms;
+  double lcd_ms;
+  double quantize_ms;
+  double solve_ms;
+  double total_ms;
+
+  //iterations of an iterative solver, 0 for closed-form algorithms
+  int iterations;
+
+  //pixels of the input image
+  long long pixels;
+
+  //bytes allocated for images during the call, by the calling thread and by
+  //the threads of the pool running its tasks (see
+  //thread_image_allocated_bytes()). Other threads, such as the reader and
+  //writer of a pipeline, are not counted, and neither are the std::vector
+  //and fft scratch buffers of the filters.
+  unsigned long long allocated_bytes;
+
+  //number of threads, and fraction of their time spent running the parallel
+  //tasks of the call (see thread_busy_time())
+  int threads;
+  double thread_utilization;
+
+  ProcessStats()
+  {
+    clear();
+  }
+
+  void clear()
+  {
+    sqrt_ms = blur_ms = divide_ms = dlp_ms = lcd_ms = quantize_ms = solve_ms = total_ms = 0.;
+    iterations = 0;
+    pixels = 0;
+    allocated_bytes = 0;
+    threads = 0;
+    thread_utilization = 0.;
+  }
+
+  void print(std::ostream& out) const
+  {
+    out << "sqrt " << sqrt_ms << "ms, blur " << blur_ms << "ms, divide " << divide_ms
+        << "ms, dlp " << dlp_ms << "ms, lcd " << lcd_ms << "ms, quantize " << quantize_ms << "ms, ";
+    if(iterations > 0)
+      out << "solve " << solve_ms << "ms (" << iterations << " iterations), ";
+    out << "total " << total_ms << "ms, " << pixels << " pixels, "
+        << allocated_bytes << " bytes allocated, " << threads << " threads "
+        << int(100.*thread_utilization + 0.5) << "% busy";
+  }
+};
+
 /* base hdr display class ***************************************************************/
 
 /**
@@ -12,6 +90,19 @@
  *        in order to define a new algorithm, it is required to extend this
  *        class, implement the process() function and define its conrresponding
  *        parameter class
+ *
+ *        process() is meant to be called on every frame of a sequence :
+ *        implementations keep their intermediate images as (mutable) members
+ *        and resize them (see ImageT::resize()), so that frames of the same
+ *        size are processed without allocation. As a consequence, an instance
+ *        must not run process() on several threads at the same time.
+ *
+ *        when enabled (see set_stats()), process() fills a ProcessStats with
+ *        the time of each stage, using begin_stats(), lap() and end_stats().
+ *
+ *        implementations compute their outputs with output_luma(), which
+ *        quantizes them in the same pass when process() is called with
+ *        QuantizedImage outputs.
  */
 template <class TImage, class TParams>
 class BaseHDRDisplay
@@ -21,9 +112,12 @@ public:
   typedef TParams ParameterType;
 
 public:
-  BaseHDRDisplay() {}
+  BaseHDRDisplay()
+  : m_stats_enabled(false), m_quantized_bits(0), m_dither(false), m_quantized_out1(NULL), m_quantized_out2(NULL)
+  {}
+
   BaseHDRDisplay(const ParameterType& params)
-  : m_params(params)
+  : m_params(params), m_stats_enabled(false), m_quantized_bits(0), m_dither(false), m_quantized_out1(NULL), m_quantized_out2(NULL)
   {}
 
   virtual ~BaseHDRDisplay() {}
@@ -33,11 +127,155 @@ public:
     m_params = params;
   }
 
+  /**
+   * @brief enables or disables the statistics of process()
+   */
+  void set_stats(bool enabled)
+  {
+    m_stats_enabled = enabled;
+    m_stats.clear();
+  }
+
+  /**
+   * @brief statistics of the last call to process(), if enabled
+   */
+  inline const ProcessStats& stats() const
+  {
+    return m_stats;
+  }
+
 public:
   virtual void process(const ImageType& hdr_in, ImageType& ldr_out1, ImageType& ldr_out2) const = 0;
 
+  /**
+   * @brief same as process(), with both outputs quantized to integers of
+   *        bits bits (see quantize()). The quantization is done by the last
+   *        stage of the algorithm (see output_luma()), so that the floating
+   *        point outputs are never stored for the whole frame.
+   */
+  void process(const ImageType& hdr_in, int bits, bool dither, QuantizedImage& ldr_out1, QuantizedImage& ldr_out2) const
+  {
+    m_quantized_bits = std::min(std::max(bits, 1), 16);
+    m_dither = dither;
+    m_quantized_out1 = &ldr_out1;
+    m_quantized_out2 = &ldr_out2;
+
+    process(hdr_in, m_ldr_out1, m_ldr_out2);
+
+    m_quantized_bits = 0;
+    m_dither = false;
+    m_quantized_out1 = m_quantized_out2 = NULL;
+  }
+
+protected:
+  typedef std::chrono::steady_clock Clock;
+
+  /**
+   * @brief starts the statistics of a call to process()
+   */
+  void begin_stats(const ImageType& hdr_in) const
+  {
+    if(!m_stats_enabled)
+      return;
+
+    m_stats.clear();
+    m_stats.pixels = (long long)(hdr_in.width())*hdr_in.height();
+    m_stats.threads = thread_count();
+
+    m_begin_allocated = thread_image_allocated_bytes();
+    m_begin_busy = thread_busy_time();
+    m_begin = m_lap = Clock::now();
+  }
+
+  /**
+   * @brief adds the time elapsed since the previous lap to stage_ms
+   */
+  void lap(double ProcessStats::* stage_ms) const
+  {
+    if(!m_stats_enabled)
+      return;
+
+    Clock::time_point now = Clock::now();
+    m_stats.*stage_ms += std::chrono::duration<double, std::milli>(now - m_lap).count();
+    m_lap = now;
+  }
+
+  /**
+   * @brief last stage of process() : ldr_out = response.luma(in). Called from
+   *        the quantized process(), quantized receives the result instead and
+   *        ldr_out is not used : the luma is computed by strips of columns,
+   *        which are quantized while they are in cache.
+   * @param quantized is the quantized output (m_quantized_out1 or
+   *        m_quantized_out2), NULL for the floating point process()
+   */
+  template<class TResponse>
+  void output_luma(const TResponse& response, const ImageType& in, ImageType& ldr_out, QuantizedImage* quantized) const
+  {
+    if(!quantized){
+      response.luma(in, ldr_out);
+      return;
+    }
+
+    int h = in.height();
+    int w = in.width();
+    int c = in.channel();
+
+    quantized->resize(h, w, c, m_quantized_bits);
+
+    typedef typename ImageType::Scalar Scalar;
+    Scalar* data = const_cast<Scalar*>(in.data().data());
+    int stride = int(in.data().outerStride());
+
+    //columns per strip
+    const int strip_size = 32;
+
+    parallel_for((w + strip_size - 1)/strip_size, [&](int strip)
+    {
+      int x0 = strip*strip_size, sw = std::min(strip_size, w - x0);
+
+      //columns [x0, x0+sw) of in, and their luma
+      const ImageType columns(h, sw, c, data + size_t(x0)*h*in.pixel_stride(), stride);
+      static thread_local ImageType luma;
+
+      response.luma(columns, luma);
+      quantize_tile(luma, m_dither, x0, 0, *quantized);
+    });
+  }
+
+  /**
+   * @brief completes the statistics of a call to process()
+   */
+  void end_stats() const
+  {
+    if(!m_stats_enabled)
+      return;
+
+    double elapsed = std::chrono::duration<double>(Clock::now() - m_begin).count();
+
+    m_stats.total_ms = 1e3*elapsed;
+    m_stats.allocated_bytes = thread_image_allocated_bytes() - m_begin_allocated;
+    if(elapsed > 0.)
+      m_stats.thread_utilization = (thread_busy_time() - m_begin_busy)/(elapsed*m_stats.threads);
+  }
+
 protected:
   ParameterType m_params;
+
+  bool m_stats_enabled;
+  mutable ProcessStats m_stats;
+  mutable Clock::time_point m_begin, m_lap;
+  mutable unsigned long long m_begin_allocated;
+  mutable double m_begin_busy;
+
+  //outputs of the quantized process(), NULL for the floating point one
+  mutable int m_quantized_bits;
+  mutable bool m_dither;
+  mutable QuantizedImage* m_quantized_out1;
+  mutable QuantizedImage* m_quantized_out2;
+
+  //floating point outputs given to process() by the quantized process(),
+  //unused when the outputs are computed by output_luma()
+  mutable ImageType m_ldr_out1, m_ldr_out2;
 };
 
 /* projector-based display algorithm ***************************************************/
@@ -56,6 +294,35 @@ protected:
  *          - psf : the projector's psf model
  *          - dlp_response : the response model of the dlp projector
  *          - lcd_response : the response model of the lcd screen
+ *
+ *        two execution modes are available :
+ *          - by default each step is applied to the whole frame
+ *          - the fused mode (see set_fused()) streams tiles through all the
+ *            steps while they are in cache, each tile being padded by the psf
+ *            size. Results are identical to the default mode for separable
+ *            psfs and for kernels convolved directly, and differ by rounding
+ *            errors (relative error ~1e-12) when the default mode uses the fft
+ *            convolution. It is meant for separable or small psfs, and is
+ *            only used with the exact blur of the psf (see
+ *            BasePSF::set_blur()) : the other blur modes work on the whole
+ *            frame, so the default mode is used instead.
+ *          - the incremental mode (see set_incremental()) is the fused mode
+ *            restricted to the tiles whose padded input changed since the
+ *            previous frame. The outputs of the other tiles are kept from the
+ *            previous frame, so results are identical to the ones of a full
+ *            recompute. It is only used when the fused mode gives the same
+ *            results as the default mode : with the exact blur of a separable
+ *            psf, or of a kernel convolved directly.
+ *
+ *        the dlp image can have its own resolution (see
+ *        set_backlight_resolution()), usually lower than the one of the lcd
+ *        since its content is blurred anyway. The input is then resampled to
+ *        the resolution of the dlp (see ImageT::resample()), its square root
+ *        is blurred and mapped by the dlp response at that resolution, and
+ *        the division by the blurred backlight interpolates it bilinearly for
+ *        each pixel of the lcd. The psf must then be expressed in pixels of
+ *        the dlp, and the whole frame is processed at once (the fused and
+ *        incremental modes are not used).
  */
 
 template <class TImage, class TParams>
@@ -67,40 +334,733 @@ public:
   typedef typename SuperClass::ImageType         ImageType;
   typedef typename SuperClass::ParameterType ParameterType;
 
+  typedef typename ImageType::Scalar Scalar;
+
+  //quantized outputs
+  using SuperClass::process;
+
 public:
-  ProjectorBasedDisplay() : SuperClass() {}
+  ProjectorBasedDisplay()
+  : SuperClass(), m_fused(false), m_incremental(false), m_tile_size(64),
+    m_backlight_height(0), m_backlight_width(0), m_retained_version(0), m_retained_psf(NULL), m_retained_dlp(NULL), m_retained_lcd(NULL),
+    m_retained_dlp_version(0), m_retained_lcd_version(0), m_retained_bits(0), m_retained_dither(false)
+  {}
+
   ProjectorBasedDisplay(const ParameterType& params)
-  : SuperClass(params)
+  : SuperClass(params), m_fused(false), m_incremental(false), m_tile_size(64),
+    m_backlight_height(0), m_backlight_width(0), m_retained_version(0), m_retained_psf(NULL), m_retained_dlp(NULL), m_retained_lcd(NULL),
+    m_retained_dlp_version(0), m_retained_lcd_version(0), m_retained_bits(0), m_retained_dither(false)
   {}
 
   virtual ~ProjectorBasedDisplay() {}
 
+public:
+  /**
+   * @brief enables or disables the fused execution mode
+   * @param tile_size is the size of the square tiles processed at once, at
+   *        least 1
+   */
+  void set_fused(bool fused, int tile_size=64)
+  {
+    m_fused = fused;
+    m_tile_size = std::max(tile_size, 1);
+    reset();
+  }
+
+  /**
+   * @brief enables or disables the incremental execution mode
+   * @param tile_size is the size of the square tiles compared with the
+   *        previous frame and recomputed, at least 1
+   */
+  void set_incremental(bool incremental, int tile_size=64)
+  {
+    m_incremental = incremental;
+    m_tile_size = std::max(tile_size, 1);
+    reset();
+  }
+
+  /**
+   * @brief sets the resolution of the dlp image, 0 (or the size of the
+   *        input) computes it at the resolution of the input
+   */
+  void set_backlight_resolution(int height, int width)
+  {
+    m_backlight_height = height;
+    m_backlight_width = width;
+    reset();
+  }
+
+  /**
+   * @brief discards the previous frame of the incremental mode, so that the
+   *        next frame is fully recomputed. Changes of the psf and of the
+   *        display responses (see BasePSF::version() and
+   *        BaseDisplayResponse::version()) and of the models given to
+   *        set_model_parameters() are detected without calling it.
+   */
+  void reset() const
+  {
+    m_previous = ImageType();
+    m_retained_version = 0;
+  }
+
 public:
   virtual void process(const ImageType &hdr_in, ImageType &ldr_out1, ImageType &ldr_out2) const
+  {
+    this->begin_stats(hdr_in);
+
+    bool dual = m_backlight_height > 0 && m_backlight_width > 0 &&
+                (m_backlight_height != hdr_in.height() || m_backlight_width != hdr_in.width());
+    bool incremental = !dual && m_incremental && is_tiling_exact(hdr_in);
+    bool fused = incremental || (!dual && m_fused && this->m_params.psf->blur() == BLUR_EXACT);
+
+    if(dual)
+      process_dual(hdr_in, ldr_out1, ldr_out2);
+    else if(incremental)
+      process_incremental(hdr_in, ldr_out1, ldr_out2);
+    else if(fused)
+      process_fused(hdr_in, ldr_out1, ldr_out2, this->m_quantized_out1, this->m_quantized_out2);
+    else
+      process_frame(hdr_in, ldr_out1, ldr_out2);
+
+    if(!incremental && m_retained_version != 0)
+      reset();
+
+    this->end_stats();
+  }
+
+protected:
+  /**
+   * @brief applies each step of the algorithm to the whole frame
+   */
+  void process_frame(const ImageType &hdr_in, ImageType &ldr_out1, ImageType &ldr_out2) const
   {
     int h = hdr_in.height();
     int w = hdr_in.width();
+    int c = hdr_in.channel();
 
     //compute sqrt(I)
-    ImageType sqroot(h, w);
-    sqroot.data() = hdr_in.data().sqrt();
+    m_sqroot.resize(h, w, c);
+    m_sqroot.data() = hdr_in.data().sqrt();
+    this->lap(&ProcessStats::sqrt_ms);
 
-    //compute convolution(psf, sqrt(I))
-    ImageType kernel, temp;
-    this->m_params.psf->generate(kernel);
-    sqroot.convolve(kernel, temp);
+    //compute convolution(psf, sqrt(I)), according to the blur mode of the psf
+    this->m_params.psf->convolve(m_sqroot, m_temp);
+    this->lap(&ProcessStats::blur_ms);
 
     //compute I/convolution(psf, sqrt(I));
-    temp.data() = hdr_in.data()/temp.data();
+    m_temp.data() = hdr_in.data()/m_temp.data();
+    this->lap(&ProcessStats::divide_ms);
 
     //compute the dlp image using the projector's response
-    ldr_out1 = ImageType(h, w);
-    this->m_params.dlp_response->luma(sqroot, ldr_out1);
+    this->output_luma(*this->m_params.dlp_response, m_sqroot, ldr_out1, this->m_quantized_out1);
+    this->lap(&ProcessStats::dlp_ms);
 
     //compute the lcd image using the screen's response
-    ldr_out2 = ImageType(h, w);
-    this->m_params.lcd_response->luma(temp, ldr_out2);
+    this->output_luma(*this->m_params.lcd_response, m_temp, ldr_out2, this->m_quantized_out2);
+    this->lap(&ProcessStats::lcd_ms);
   }
+
+  /**
+   * @brief process_frame() with the dlp image at the backlight resolution
+   */
+  void process_dual(const ImageType &hdr_in, ImageType &ldr_out1, ImageType &ldr_out2) const
+  {
+    int h = hdr_in.height();
+    int w = hdr_in.width();
+    int c = hdr_in.channel();
+
+    int bh = m_backlight_height;
+    int bw = m_backlight_width;
+
+    //compute sqrt(I) at the backlight resolution
+    hdr_in.resample(bh, bw, m_sqroot);
+    m_sqroot.data() = m_sqroot.data().sqrt();
+    this->lap(&ProcessStats::sqrt_ms);
+
+    //compute convolution(psf, sqrt(I)), according to the blur mode of the psf
+    this->m_params.psf->convolve(m_sqroot, m_blurred);
+    this->lap(&ProcessStats::blur_ms);
+
+    //compute I/convolution(psf, sqrt(I)), the blurred backlight being
+    //interpolated as in ImageT::resample(). The rows and weights are the
+    //same for every column
+    m_rows.resize(2*h);
+    m_row_weights.resize(h);
+    for(int j=0; j<h; ++j)
+      locate(j, h, bh, m_rows[2*j], m_rows[2*j+1], m_row_weights[j]);
+
+    m_temp.resize(h, w, c);
+    const ImageType& blurred = m_blurred;
+    parallel_for(w, [&](int i)
+    {
+      int i0, i1; Scalar a;
+      locate(i, w, bw, i0, i1, a);
+
+      //column of the backlight at the position of column i, then interpolated
+      //along the rows for each pixel
+      static thread_local std::vector<Scalar> column;
+      static thread_local typename ImageType::ChannelType backlight;
+      column.resize(bh);
+      backlight.resize(h);
+
+      for(int ch=0; ch<c; ++ch){
+        for(int k=0; k<bh; ++k)
+          column[k] = (1-a)*blurred.data(i0, k, ch) + a*blurred.data(i1, k, ch);
+
+        for(int j=0; j<h; ++j){
+          Scalar b = m_row_weights[j];
+          backlight(j) = (1-b)*column[m_rows[2*j]] + b*column[m_rows[2*j+1]];
+        }
+
+        m_temp.data().col(ch).segment(i*h, h) = hdr_in.data().col(ch).segment(i*h, h) / backlight;
+      }
+    });
+    this->lap(&ProcessStats::divide_ms);
+
+    //compute the dlp image using the projector's response
+    this->output_luma(*this->m_params.dlp_response, m_sqroot, ldr_out1, this->m_quantized_out1);
+    this->lap(&ProcessStats::dlp_ms);
+
+    //compute the lcd image using the screen's response
+    this->output_luma(*this->m_params.lcd_response, m_temp, ldr_out2, this->m_quantized_out2);
+    this->lap(&ProcessStats::lcd_ms);
+  }
+
+  /**
+   * @brief position of pixel p of an image of size pixels in an image of
+   *        size_in pixels covering the same area : linear interpolation
+   *        between p0 and p1 with weight alpha for p1, clamped at the border
+   */
+  static void locate(int p, int size, int size_in, int& p0, int& p1, Scalar& alpha)
+  {
+    double u = (p + 0.5)*size_in/size - 0.5, u0 = std::floor(u);
+    p0 = std::min(std::max(int(u0), 0), size_in-1);
+    p1 = std::min(std::max(int(u0) + 1, 0), size_in-1);
+    alpha = Scalar(u - u0);
+  }
+
+  /**
+   * @brief true if the fused mode gives the same results as the default mode
+   */
+  bool is_tiling_exact(const ImageType& hdr_in) const
+  {
+    const auto& psf = *this->m_params.psf;
+    if(psf.blur() != BLUR_EXACT)
+      return false;
+
+    const ImageType& kernel = psf.kernel();
+    return psf.is_separable() ||
+           !FFTConvolution::is_faster(hdr_in.height(), hdr_in.width(), kernel.height(), kernel.width());
+  }
+
+  /**
+   * @brief applies the fused mode to the tiles whose padded input changed
+   *        since the previous frame, and patches the outputs kept from the
+   *        previous frame
+   */
+  void process_incremental(const ImageType &hdr_in, ImageType &ldr_out1, ImageType &ldr_out2) const
+  {
+    int h = hdr_in.height();
+    int w = hdr_in.width();
+    int c = hdr_in.channel();
+
+    const auto& psf = *this->m_params.psf;
+    const ImageType& kernel = psf.kernel();
+
+    int n_tiles_x = (w + m_tile_size - 1)/m_tile_size;
+    int n_tiles_y = (h + m_tile_size - 1)/m_tile_size;
+    int n_tiles = n_tiles_x*n_tiles_y;
+
+    //the previous frame is only valid for the same size, models and outputs
+    bool quantized = this->m_quantized_out1 != NULL;
+    bool valid = m_retained_version == psf.version() && m_retained_psf == this->m_params.psf &&
+                 m_retained_dlp == this->m_params.dlp_response && m_retained_lcd == this->m_params.lcd_response &&
+                 m_retained_dlp_version == this->m_params.dlp_response->version() &&
+                 m_retained_lcd_version == this->m_params.lcd_response->version() &&
+                 m_previous.height() == h && m_previous.width() == w && m_previous.channel() == c &&
+                 m_retained_bits == (quantized ? this->m_quantized_bits : 0) && m_retained_dither == this->m_dither;
+
+    //tiles that changed
+    m_changed.assign(n_tiles, 1);
+    if(valid){
+      parallel_for(n_tiles, [&](int tile)
+      {
+        int x0 = (tile / n_tiles_y) * m_tile_size, tw = std::min(m_tile_size, w - x0);
+        int y0 = (tile % n_tiles_y) * m_tile_size, th = std::min(m_tile_size, h - y0);
+
+        bool changed = false;
+        for(int i=x0; i<x0+tw && !changed; ++i)
+          changed = (hdr_in.data().middleRows(i*h + y0, th) != m_previous.data().middleRows(i*h + y0, th)).any();
+
+        m_changed[tile] = changed;
+      });
+    }
+    else
+      m_previous.resize(h, w, c);
+
+    //a tile is recomputed when a changed pixel is within the psf radius,
+    //i.e. within r tiles of a changed tile
+    int r_x = (std::max(kernel.width()/2 , kernel.width() - 1 - kernel.width()/2) + m_tile_size - 1)/m_tile_size;
+    int r_y = (std::max(kernel.height()/2, kernel.height() - 1 - kernel.height()/2) + m_tile_size - 1)/m_tile_size;
+
+    m_dirty.assign(n_tiles, 0);
+    for(int tile=0; tile<n_tiles; ++tile){
+      if(!m_changed[tile])
+        continue;
+
+      int tx = tile / n_tiles_y, ty = tile % n_tiles_y;
+      for(int x=std::max(0, tx - r_x); x<=std::min(n_tiles_x - 1, tx + r_x); ++x)
+        for(int y=std::max(0, ty - r_y); y<=std::min(n_tiles_y - 1, ty + r_y); ++y)
+          m_dirty[x*n_tiles_y + y] = 1;
+    }
+
+    m_tiles.clear();
+    for(int tile=0; tile<n_tiles; ++tile)
+      if(m_dirty[tile])
+        m_tiles.push_back(tile);
+
+    if(!m_tiles.empty()){
+      if(quantized)
+        process_fused(hdr_in, m_retained_out1, m_retained_out2, &m_retained_quantized1, &m_retained_quantized2, &m_tiles);
+      else
+        process_fused(hdr_in, m_retained_out1, m_retained_out2, NULL, NULL, &m_tiles);
+    }
+
+    //keep the changed tiles of the input for the next frame
+    parallel_for(n_tiles, [&](int tile)
+    {
+      if(!m_changed[tile])
+        return;
+
+      int x0 = (tile / n_tiles_y) * m_tile_size, tw = std::min(m_tile_size, w - x0);
+      int y0 = (tile % n_tiles_y) * m_tile_size, th = std::min(m_tile_size, h - y0);
+      for(int i=x0; i<x0+tw; ++i)
+        m_previous.data().middleRows(i*h + y0, th) = hdr_in.data().middleRows(i*h + y0, th);
+    });
+
+    m_retained_version = psf.version();
+    m_retained_psf = this->m_params.psf;
+    m_retained_dlp = this->m_params.dlp_response;
+    m_retained_lcd = this->m_params.lcd_response;
+    m_retained_dlp_version = this->m_params.dlp_response->version();
+    m_retained_lcd_version = this->m_params.lcd_response->version();
+    m_retained_bits = quantized ? this->m_quantized_bits : 0;
+    m_retained_dither = this->m_dither;
+
+    if(quantized){
+      *this->m_quantized_out1 = m_retained_quantized1;
+      *this->m_quantized_out2 = m_retained_quantized2;
+    }
+    else{
+      ldr_out1 = m_retained_out1;
+      ldr_out2 = m_retained_out2;
+    }
+  }
+
+  /**
+   * @brief applies all the steps of the algorithm tile by tile
+   * @param quantized1, quantized2 receive the outputs quantized tile by tile
+   *        instead of ldr_out1 and ldr_out2, unless they are NULL
+   * @param tiles are the indices of the tiles to process (x major), all the
+   *        tiles if NULL
+   */
+  void process_fused(const ImageType &hdr_in, ImageType &ldr_out1, ImageType &ldr_out2,
+                     QuantizedImage* quantized1, QuantizedImage* quantized2,
+                     const std::vector<int>* tiles=NULL) const
+  {
+    int h = hdr_in.height();
+    int w = hdr_in.width();
+    int c = hdr_in.channel();
+
+    //kernels are generated before the tiles are distributed among threads
+    bool separable = this->m_params.psf->is_separable();
+    const ImageType& kernel   = this->m_params.psf->kernel();
+    const ImageType& kernel_x = this->m_params.psf->kernel_x();
+    const ImageType& kernel_y = this->m_params.psf->kernel_y();
+    this->lap(&ProcessStats::blur_ms);
+
+    int w_ker = kernel.width() ; int w_ker_2 = w_ker/2;
+    int h_ker = kernel.height(); int h_ker_2 = h_ker/2;
+
+    if(quantized1){
+      quantized1->resize(h, w, c, this->m_quantized_bits);
+      quantized2->resize(h, w, c, this->m_quantized_bits);
+    }
+    else{
+      ldr_out1.resize(h, w, c);
+      ldr_out2.resize(h, w, c);
+    }
+
+    int n_tiles_x = (w + m_tile_size - 1)/m_tile_size;
+    int n_tiles_y = (h + m_tile_size - 1)/m_tile_size;
+
+    //time spent in each stage by all threads, in nanoseconds
+    typedef std::chrono::steady_clock Clock;
+    enum { SQRT, BLUR, DIVIDE, DLP, LCD, QUANTIZE, STAGES };
+    std::atomic<long long> stage_ns[STAGES];
+    for(int k=0; k<STAGES; ++k)
+      stage_ns[k] = 0;
+
+    int n_processed = tiles ? int(tiles->size()) : n_tiles_x*n_tiles_y;
+    parallel_for(n_processed, [&](int index)
+    {
+      int tile = tiles ? (*tiles)[index] : index;
+
+      Clock::time_point time = this->m_stats_enabled ? Clock::now() : Clock::time_point();
+      auto lap = [&](int stage)
+      {
+        if(!this->m_stats_enabled)
+          return;
+
+        Clock::time_point now = Clock::now();
+        stage_ns[stage] += std::chrono::duration_cast<std::chrono::nanoseconds>(now - time).count();
+        time = now;
+      };
+
+      //per thread intermediate images, reused from one tile (and frame) to
+      //the next
+      static thread_local ImageType padded, blurred, sqroot, temp, dlp, lcd;
+
+      int x0 = (tile / n_tiles_y) * m_tile_size, tw = std::min(m_tile_size, w - x0);
+      int y0 = (tile % n_tiles_y) * m_tile_size, th = std::min(m_tile_size, h - y0);
+
+      //compute sqrt(I) on the tile padded by the kernel size
+      int pw = tw + w_ker - 1;
+      int ph = th + h_ker - 1;
+
+      //rows [j0, j1) of the padded tile are inside the frame, the others are
+      //mirrored
+      int j0 = std::max(0, h_ker_2 - y0);
+      int j1 = std::min(ph, h - y0 + h_ker_2);
+
+      padded.resize(ph, pw, c);
+      for(int i=0; i<pw; ++i){
+        int px_i = ImageType::mirror(x0 - w_ker_2 + i, w);
+
+        padded.data().middleRows(i*ph + j0, j1 - j0) = hdr_in.data().middleRows(px_i*h + y0 - h_ker_2 + j0, j1 - j0).sqrt();
+
+        for(int j=0; j<j0; ++j)
+          padded.data().row(i*ph + j) = hdr_in.data().row(px_i*h + ImageType::mirror(y0 - h_ker_2 + j, h)).sqrt();
+        for(int j=j1; j<ph; ++j)
+          padded.data().row(i*ph + j) = hdr_in.data().row(px_i*h + ImageType::mirror(y0 - h_ker_2 + j, h)).sqrt();
+      }
+      lap(SQRT);
+
+      //compute convolution(psf, sqrt(I))
+      if(separable)
+        padded.convolve_separable_valid(kernel_x, kernel_y, blurred);
+      else
+        padded.convolve_valid(kernel, blurred);
+      lap(BLUR);
+
+      //compute I/convolution(psf, sqrt(I)), and extract the unpadded sqrt(I)
+      sqroot.resize(th, tw, c);
+      temp.resize(th, tw, c);
+      for(int i=0; i<tw; ++i){
+        sqroot.data().middleRows(i*th, th) = padded.data().middleRows((i+w_ker_2)*ph + h_ker_2, th);
+        temp.data().middleRows(i*th, th)   = hdr_in.data().middleRows((x0+i)*h + y0, th) / blurred.data().middleRows(i*th, th);
+      }
+      lap(DIVIDE);
+
+      //compute the dlp and lcd images using the responses
+      this->m_params.dlp_response->luma(sqroot, dlp);
+      lap(DLP);
+      this->m_params.lcd_response->luma(temp, lcd);
+      lap(LCD);
+
+      if(quantized1){
+        quantize_tile(dlp, this->m_dither, x0, y0, *quantized1);
+        quantize_tile(lcd, this->m_dither, x0, y0, *quantized2);
+        lap(QUANTIZE);
+        return;
+      }
+
+      for(int i=0; i<tw; ++i){
+        ldr_out1.data().middleRows((x0+i)*h + y0, th) = dlp.data().middleRows(i*th, th);
+        ldr_out2.data().middleRows((x0+i)*h + y0, th) = lcd.data().middleRows(i*th, th);
+      }
+    });
+
+    if(this->m_stats_enabled){
+      double ProcessStats::* stages[STAGES] = { &ProcessStats::sqrt_ms, &ProcessStats::blur_ms, &ProcessStats::divide_ms,
+                                                &ProcessStats::dlp_ms, &ProcessStats::lcd_ms, &ProcessStats::quantize_ms };
+      for(int k=0; k<STAGES; ++k)
+        this->m_stats.*stages[k] += 1e-6*double(stage_ns[k]);
+    }
+  }
+
+protected:
+  bool m_fused;
+  bool m_incremental;
+  int m_tile_size;
+  int m_backlight_height;
+  int m_backlight_width;
+
+  //intermediate images, kept between frames
+  mutable ImageType m_sqroot, m_temp, m_blurred;
+  mutable std::vector<int> m_rows;
+  mutable std::vector<Scalar> m_row_weights;
+
+  //incremental mode : previous input and outputs, and the models that
+  //computed them (a version of 0 means that there is no previous frame)
+  mutable ImageType m_previous, m_retained_out1, m_retained_out2;
+  mutable unsigned int m_retained_version;
+  mutable const void* m_retained_psf;
+  mutable const void* m_retained_dlp;
+  mutable const void* m_retained_lcd;
+  mutable unsigned int m_retained_dlp_version;
+  mutable unsigned int m_retained_lcd_version;
+  mutable std::vector<char> m_changed, m_dirty;
+
+  //incremental mode with quantized outputs : the outputs are kept quantized,
+  //with the bits (0 for floating point outputs) and dithering of the
+  //previous frame
+  mutable QuantizedImage m_retained_quantized1, m_retained_quantized2;
+  mutable int m_retained_bits;
+  mutable bool m_retained_dither;
+  mutable std::vector<int> m_tiles;
+};
+
+/* iterative projector-based display algorithm *****************************************/
+
+/**
+ *`@brief a refinement of the projector-based display algorithm (see
+ *        ProjectorBasedDisplay) that accounts for the clamping of the outputs.
+ *        With B the luminance of the dlp and L its convolution with the psf,
+ *        the lcd transmittance I/L is clamped to the range of the lcd, so the
+ *        displayed image differs from I wherever I/L falls outside of it
+ *        (highlights brighter than the backlight, blacks darker than its
+ *        leakage). The closed-form split B = sqrt(I) ignores this.
+ *
+ *        here B = sqrt(I)*C, clamped to the range of the dlp, where the
+ *        correction C is smooth and solved for in the log domain : each
+ *        iteration computes the log ratio e between L and the nearest backlight
+ *        for which I/L is in the range of the lcd, and subtracts its
+ *        convolution with the psf (the gradient of the squared log error with
+ *        respect to log B) from log C.
+ *
+ *        the solve is coarse-to-fine : log C is solved on images reduced by
+ *        2^levels with the reduced psf (see BasePSF::convolve_reduced()) until
+ *        its mean change is below the tolerance, then upsampled and
+ *        optionally refined with the error at full resolution. log C is kept
+ *        from one frame to the next as a warm start, so a sequence converges
+ *        in one or two iterations per frame. The full resolution blurs use the
+ *        blur mode of the psf : the cost is the one of ProjectorBasedDisplay
+ *        plus the (small) coarse iterations, and one blur per refinement.
+ *
+ *        TParam is the same as for ProjectorBasedDisplay.
+ */
+
+template <class TImage, class TParams>
+class IterativeProjectorDisplay : public BaseHDRDisplay<TImage, TParams>
+{
+public:
+  typedef BaseHDRDisplay<TImage, TParams> SuperClass;
+
+  typedef typename SuperClass::ImageType         ImageType;
+  typedef typename SuperClass::ParameterType ParameterType;
+
+  typedef typename ImageType::Scalar Scalar;
+
+  //quantized outputs
+  using SuperClass::process;
+
+public:
+  IterativeProjectorDisplay()
+  : SuperClass(), m_levels(3), m_iterations(10), m_refinements(0), m_tolerance(0.01)
+  {}
+
+  IterativeProjectorDisplay(const ParameterType& params)
+  : SuperClass(params), m_levels(3), m_iterations(10), m_refinements(0), m_tolerance(0.01)
+  {}
+
+  virtual ~IterativeProjectorDisplay() {}
+
+public:
+  /**
+   * @brief sets the parameters of the solver
+   * @param levels : the coarse solve works on images reduced by 2^levels
+   * @param iterations : maximum number of coarse iterations per frame
+   * @param refinements : number of iterations at full resolution
+   * @param tolerance : the coarse iterations stop when the mean change of
+   *        log C is below tolerance
+   */
+  void set_solver(int levels, int iterations, int refinements=0, double tolerance=0.01)
+  {
+    m_levels = std::max(levels, 0);
+    m_iterations = std::max(iterations, 0);
+    m_refinements = std::max(refinements, 0);
+    m_tolerance = tolerance;
+  }
+
+  /**
+   * @brief discards the warm start, e.g. on a scene cut
+   */
+  void reset() const
+  {
+    m_correction = ImageType();
+  }
+
+public:
+  virtual void process(const ImageType &hdr_in, ImageType &ldr_out1, ImageType &ldr_out2) const
+  {
+    this->begin_stats(hdr_in);
+
+    int h = hdr_in.height();
+    int w = hdr_in.width();
+    int c = hdr_in.channel();
+    int factor = 1 << m_levels;
+
+    //ranges of the dlp luminance and of the lcd transmittance, the luminances
+    //are kept above floor so that their logs are defined
+    Scalar b_min, b_max, t_min, t_max;
+    range(*this->m_params.dlp_response, c, b_min, b_max);
+    range(*this->m_params.lcd_response, c, t_min, t_max);
+
+    Scalar floor = Scalar(1e-12)*b_max*t_max;
+    b_min = std::max(b_min, floor);
+
+    //compute sqrt(I)
+    m_target.resize(h, w, c);
+    m_target.data() = hdr_in.data().max(floor);
+    m_sqroot.resize(h, w, c);
+    m_sqroot.data() = m_target.data().sqrt();
+    this->lap(&ProcessStats::sqrt_ms);
+
+    //coarse solve, starting from the correction of the previous frame
+    m_target.downsample(factor, m_target_c);
+    m_sqroot.downsample(factor, m_sqroot_c);
+
+    if(m_correction.height() != m_sqroot_c.height() || m_correction.width() != m_sqroot_c.width() ||
+       m_correction.channel() != c){
+      m_correction.resize(m_sqroot_c.height(), m_sqroot_c.width(), c);
+      m_correction.data().setZero();
+    }
+
+    //bounds of log C beyond which B is clamped, the error would accumulate
+    //in C otherwise
+    m_lower_c.resize(m_sqroot_c.height(), m_sqroot_c.width(), c);
+    m_upper_c.resize(m_sqroot_c.height(), m_sqroot_c.width(), c);
+    m_lower_c.data() = (m_sqroot_c.data().inverse() * b_min).log();
+    m_upper_c.data() = (m_sqroot_c.data().inverse() * b_max).log();
+
+    int iterations = 0;
+    while(iterations < m_iterations){
+      ++iterations;
+
+      m_backlight_c.resize(m_sqroot_c.height(), m_sqroot_c.width(), c);
+      m_backlight_c.data() = m_sqroot_c.data() * m_correction.data().exp();
+      this->m_params.psf->convolve_reduced(m_backlight_c, m_levels, m_blurred_c);
+
+      error(m_target_c, m_blurred_c, t_min, t_max, m_error_c);
+      if(step() < m_tolerance)
+        break;
+    }
+    this->lap(&ProcessStats::solve_ms);
+
+    //full resolution refinements
+    for(int r=0; ; ++r){
+      //compute B = sqrt(I)*C
+      m_factor_c.resize(m_correction.height(), m_correction.width(), c);
+      m_factor_c.data() = m_correction.data().exp();
+      m_factor_c.upsample(factor, h, w, m_factor);
+
+      m_backlight.resize(h, w, c);
+      m_backlight.data() = (m_sqroot.data() * m_factor.data()).max(b_min).min(b_max);
+      this->lap(&ProcessStats::solve_ms);
+
+      //compute L = convolution(psf, B), according to the blur mode of the psf
+      this->m_params.psf->convolve(m_backlight, m_blurred);
+      this->lap(&ProcessStats::blur_ms);
+
+      if(r == m_refinements)
+        break;
+
+      error(m_target, m_blurred, t_min, t_max, m_error);
+      m_error.downsample(factor, m_error_c);
+      step();
+      ++iterations;
+      this->lap(&ProcessStats::solve_ms);
+    }
+
+    //compute I/L
+    m_temp.resize(h, w, c);
+    m_temp.data() = hdr_in.data()/m_blurred.data();
+    this->lap(&ProcessStats::divide_ms);
+
+    //compute the dlp image using the projector's response
+    this->output_luma(*this->m_params.dlp_response, m_backlight, ldr_out1, this->m_quantized_out1);
+    this->lap(&ProcessStats::dlp_ms);
+
+    //compute the lcd image using the screen's response
+    this->output_luma(*this->m_params.lcd_response, m_temp, ldr_out2, this->m_quantized_out2);
+    this->lap(&ProcessStats::lcd_ms);
+
+    if(this->m_stats_enabled)
+      this->m_stats.iterations = iterations;
+
+    this->end_stats();
+  }
+
+protected:
+  /**
+   * @brief lowest and highest luminance of a display response, over all
+   *        channels
+   */
+  template <class TResponse>
+  void range(const TResponse& response, int c, Scalar& low, Scalar& high) const
+  {
+    m_range_in.resize(1, 2, c);
+    m_range_in.data().row(0).setZero();
+    m_range_in.data().row(1).setOnes();
+
+    response.luminance(m_range_in, m_range_out);
+    low  = m_range_out.data().row(0).minCoeff();
+    high = m_range_out.data().row(1).maxCoeff();
+  }
+
+  /**
+   * @brief log ratio between the backlight and the nearest backlight for
+   *        which target/backlight is in [t_min, t_max], 0 where the lcd can
+   *        reproduce the target
+   */
+  static void error(const ImageType& target, const ImageType& backlight, Scalar t_min, Scalar t_max, ImageType& out)
+  {
+    out.resize(target.height(), target.width(), target.channel());
+    out.data() = (backlight.data() / backlight.data().max(target.data()/t_max).min(target.data()/t_min)).log();
+  }
+
+  /**
+   * @brief subtracts the convolution of the coarse error with the psf from
+   *        the coarse correction
+   * @return the mean change of the correction
+   */
+  Scalar step() const
+  {
+    this->m_params.psf->convolve_reduced(m_error_c, m_levels, m_gradient_c);
+
+    m_gradient_c.data() = (m_correction.data() - m_gradient_c.data()).max(m_lower_c.data()).min(m_upper_c.data());
+    Scalar change = (m_gradient_c.data() - m_correction.data()).abs().mean();
+
+    m_correction.data() = m_gradient_c.data();
+    return change;
+  }
+
+protected:
+  int m_levels;
+  int m_iterations;
+  int m_refinements;
+  double m_tolerance;
+
+  //log of the correction at the coarse resolution, kept between frames as a
+  //warm start
+  mutable ImageType m_correction;
+
+  //intermediate images, kept between frames
+  mutable ImageType m_target, m_sqroot, m_factor, m_backlight, m_blurred, m_error, m_temp;
+  mutable ImageType m_target_c, m_sqroot_c, m_lower_c, m_upper_c, m_factor_c, m_backlight_c,
+                    m_blurred_c, m_error_c, m_gradient_c;
+  mutable ImageType m_range_in, m_range_out;
 };
 
 #endif //HDR_DISPLAY_H
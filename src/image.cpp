@@ -1,78 +1,1192 @@
 #include "image.h"
 
+#include <atomic>
+#include <cmath>
+
+#include <Eigen/LU>
+
+#include "fft_convolution.h"
+#include "parallel.h"
+
+//size of the square tiles processed by each thread. a tile and its halo
+//(the kernel size) stay in the L2 cache for common psf sizes
+static const int TILE_SIZE = 64;
+
+//number of lines filtered together by the recursive gaussian, the recursions
+//of neighbouring lines are independent and vectorized
+static const int LINE_BLOCK = 8;
+
+//largest kernel size whose convolutions are compiled for its size
+static const int MAX_FIXED_TAPS = 63;
+
+//largest number of box filters of the box cascade, more passes do not bring
+//it closer to the gaussian in a visible way
+static const int MAX_BOX_PASSES = 8;
+
+/* allocation statistics ******************************************************/
+
+static std::atomic<unsigned long long> s_allocated_bytes(0);
+
+unsigned long long
+image_allocated_bytes()
+{
+  return s_allocated_bytes;
+}
+
+unsigned long long
+thread_image_allocated_bytes()
+{
+  return current_account().allocated_bytes;
+}
+
+void
+count_image_allocation(size_t bytes)
+{
+  s_allocated_bytes += bytes;
+  current_account().allocated_bytes += bytes;
+}
+
+/* recursive gaussian *********************************************************/
+
+/**
+ * @brief the 4th order recursive gaussian filter of Deriche :
+ *          R. Deriche, "Recursively implementing the Gaussian and its
+ *          derivatives," INRIA Research Report 1893, 1993.
+ *
+ *        the impulse response is the sum of two damped cosines on each side,
+ *        each one being a causal and an anti-causal 2nd order recursion along
+ *        lines of n samples. The two sections are kept separate rather than
+ *        expanded as a 4th order recursion, whose poles are too close to 1
+ *        for large sigmas to be represented accurately.
+ *
+ *        The mirror border condition makes the lines periodic (of period 2n),
+ *        the state of each recursion at the start of a line is its periodic
+ *        steady state, so the result is the one of the infinite gaussian with
+ *        the border condition of ImageT::mirror().
+ *
+ *        A shift of the gaussian is applied to the filtered lines, by a whole
+ *        number of samples and a linear interpolation for the fraction a. The
+ *        interpolation adds a variance a(1-a), which is removed from the one
+ *        of the recursive filter. Below a sigma of 0.5, where the recursions
+ *        are not valid, the lines are only shifted.
+ */
+class RecursiveGaussian
+{
+public:
+  RecursiveGaussian(double sigma, int n, double shift=0.)
+  : m_n(n)
+  {
+    m_shift = int(std::floor(shift));
+    m_alpha = shift - m_shift;
+    sigma = std::sqrt(std::max(sigma*sigma - m_alpha*(1. - m_alpha), 0.));
+
+    m_filtered = sigma >= 0.5;
+    if(!m_filtered)
+      return;
+
+    //impulse response (a cos(w x) + b sin(w x)) exp(-d x) of each section, x
+    //being in units of sigma
+    const double a[2] = { 1.680 , -0.6803 };
+    const double b[2] = { 3.735 , -0.2598 };
+    const double w[2] = { 0.6318,  1.997  };
+    const double d[2] = { 1.783 ,  1.723  };
+
+    double sum = 0.;
+    for(int j=0; j<2; ++j){
+      Section& section = m_sections[j];
+
+      double r = std::exp(-d[j]/sigma);
+      double cos_w = std::cos(w[j]/sigma), sin_w = std::sin(w[j]/sigma);
+
+      section.causal[0] = a[j];
+      section.causal[1] = r*(b[j]*sin_w - a[j]*cos_w);
+      section.anti_causal[0] = r*(a[j]*cos_w + b[j]*sin_w);
+      section.anti_causal[1] = -r*r*a[j];
+      section.d[0] = 2.*r*cos_w;
+      section.d[1] = -r*r;
+
+      //gains of the recursions for a constant signal
+      double denominator = 1. - section.d[0] - section.d[1];
+      sum += (section.causal[0] + section.causal[1] + section.anti_causal[0] + section.anti_causal[1])/denominator;
+
+      //the state (y[k-1], y[k-2]) of a recursion with no input is multiplied
+      //by the companion matrix at each step, a period starting with the
+      //state s ends with the state M^2n s + s', s' being the state reached
+      //from 0, so the steady state is (I - M^2n)^-1 s'. When r^2n is
+      //negligible, the state only depends on the last samples of the period
+      //and the recursion is started from 0 a few sigmas before
+      section.warmup = std::min(2*n, int(std::ceil(std::log(1e-15)/std::log(r))));
+
+      Eigen::Matrix2d m, power = Eigen::Matrix2d::Identity();
+      m << section.d[0], section.d[1],
+           1.          , 0.          ;
+      for(int p=2*n; p>0; p>>=1){
+        if(p & 1)
+          power = power*m;
+        m = m*m;
+      }
+      section.steady = (Eigen::Matrix2d::Identity() - power).inverse();
+    }
+
+    //normalizes the filter
+    for(int j=0; j<2; ++j)
+      for(int i=0; i<2; ++i){
+        m_sections[j].causal[i] /= sum;
+        m_sections[j].anti_causal[i] /= sum;
+      }
+  }
+
+  /**
+   * @brief size of the buffer e given to filter()
+   */
+  int buffer_size() const
+  {
+    return (2*m_n + 4)*LINE_BLOCK;
+  }
+
+  /**
+   * @brief filters LINE_BLOCK lines, x[k*LINE_BLOCK + l] being the sample k of
+   *        line l. y receives the n*LINE_BLOCK filtered samples, e is a buffer
+   *        of buffer_size() values
+   */
+  void filter(const double* x, double* e, double* y) const
+  {
+    const int L = LINE_BLOCK;
+    int n = m_n;
+
+    if(m_filtered)
+      recursions(x, e, y);
+    else
+      std::copy(x, x + n*L, y);
+
+    //shift, the filtered lines follow the mirror border condition as well
+    if(m_shift == 0 && m_alpha == 0.)
+      return;
+
+    std::copy(y, y + n*L, e);
+    for(int k=0; k<n; ++k){
+      const double* e0 = e + ImageT<double, PLANAR>::mirror(k + m_shift, n)*L;
+      const double* e1 = e + ImageT<double, PLANAR>::mirror(k + m_shift + 1, n)*L;
+      for(int l=0; l<L; ++l)
+        y[k*L + l] = (1. - m_alpha)*e0[l] + m_alpha*e1[l];
+    }
+  }
+
+protected:
+  /**
+   * @brief the recursive filter of filter(), without the shift
+   */
+  void recursions(const double* x, double* e, double* y) const
+  {
+    const int L = LINE_BLOCK;
+    int n = m_n;
+
+    //e[k+2] is the sample k of the periodic line x[0..n-1] x[n-1..0], for k
+    //in [-2, 2n+2)
+    for(int k=-2; k<2*n+2; ++k){
+      int p = (k + 2*n) % (2*n);
+      std::copy(x + (p < n ? p : 2*n-1-p)*L, x + (p < n ? p : 2*n-1-p)*L + L, e + (k+2)*L);
+    }
+    e += 2*L;
+
+    std::fill(y, y + n*L, 0.);
+
+    for(int j=0; j<2; ++j){
+      const Section& section = m_sections[j];
+      double s[2][L];
+
+      //causal recursion, its state at sample 0 is the one reached after the
+      //period [-2n, 0)
+      clear(s);
+      for(int k=2*n-section.warmup; k<2*n; ++k)
+        step(section, section.causal, e + k*L, e + (k-1)*L, s);
+      steady(section, s);
+
+      for(int k=0; k<n; ++k){
+        step(section, section.causal, e + k*L, e + (k-1)*L, s);
+        for(int l=0; l<L; ++l)
+          y[k*L + l] += s[0][l];
+      }
+
+      //anti-causal recursion, its state at sample n-1 is the one reached
+      //after the period [n, 3n) in reverse order, i.e. [0, n) then [n, 2n)
+      clear(s);
+      for(int i=2*n-section.warmup; i<2*n; ++i){
+        int k = n-1-i < 0 ? 3*n-1-i : n-1-i;
+        step(section, section.anti_causal, e + (k+1)*L, e + (k+2)*L, s);
+      }
+      steady(section, s);
+
+      for(int k=n-1; k>=0; --k){
+        step(section, section.anti_causal, e + (k+1)*L, e + (k+2)*L, s);
+        for(int l=0; l<L; ++l)
+          y[k*L + l] += s[0][l];
+      }
+    }
+  }
+
+protected:
+  struct Section
+  {
+    double causal[2];
+    double anti_causal[2];
+    double d[2];
+    int warmup;
+    Eigen::Matrix2d steady;
+  };
+
+  /**
+   * @brief one step of a recursion : s[0] receives the new output and the
+   *        state is shifted
+   */
+  static void step(const Section& section, const double coefficients[2],
+                   const double* x0, const double* x1, double s[2][LINE_BLOCK])
+  {
+    for(int l=0; l<LINE_BLOCK; ++l){
+      double v = coefficients[0]*x0[l] + coefficients[1]*x1[l] + section.d[0]*s[0][l] + section.d[1]*s[1][l];
+      s[1][l] = s[0][l]; s[0][l] = v;
+    }
+  }
+
+  static void clear(double s[2][LINE_BLOCK])
+  {
+    for(int i=0; i<2; ++i)
+      for(int l=0; l<LINE_BLOCK; ++l)
+        s[i][l] = 0.;
+  }
+
+  /**
+   * @brief replaces the state reached from 0 by the periodic steady state
+   */
+  void steady(const Section& section, double s[2][LINE_BLOCK]) const
+  {
+    if(section.warmup < 2*m_n)
+      return;
+
+    for(int l=0; l<LINE_BLOCK; ++l){
+      Eigen::Vector2d v = section.steady*Eigen::Vector2d(s[0][l], s[1][l]);
+      s[0][l] = v(0); s[1][l] = v(1);
+    }
+  }
+
+protected:
+  int m_n;
+  Section m_sections[2];
+  bool m_filtered;
+
+  //shift of the filtered lines, m_shift + m_alpha samples
+  int m_shift;
+  double m_alpha;
+};
+
+/* box cascade ****************************************************************/
+
+/**
+ * @brief approximation of a gaussian of standard deviation sigma by passes
+ *        (at most MAX_BOX_PASSES) box filters of running sums, following :
+ *          P. Kovesi, "Fast almost-Gaussian filtering," DICTA 2010.
+ *
+ *        the variances of the boxes ((w^2-1)/12 for a width w) add up to
+ *        sigma^2 with the odd widths w and w+2, so every box is centered and
+ *        the cascade is not shifted. The whole part of shift moves the first
+ *        box, its fraction a is applied to the filtered lines by a linear
+ *        interpolation whose variance a(1-a) is removed from the one of the
+ *        boxes, as in RecursiveGaussian.
+ *
+ *        The lines are extended once by the mirror border condition with the
+ *        support of the whole cascade, each pass then shrinks them by the
+ *        width of its box, so the result is the one of the composite kernel
+ *        with the border condition of ImageT::mirror(). The cost per sample is
+ *        one addition and one subtraction per pass, whatever sigma.
+ */
+class BoxCascade
+{
+public:
+  BoxCascade(double sigma, double shift, int passes, int n)
+  : m_n(n)
+  {
+    passes = std::min(std::max(passes, 1), MAX_BOX_PASSES);
+    m_passes = passes;
+
+    int offset = int(std::floor(shift));
+    m_alpha = shift - offset;
+    double variance = std::max(sigma*sigma - m_alpha*(1. - m_alpha), 0.);
+
+    //largest odd width w whose boxes do not exceed the variance
+    int w = std::max(1, int(std::floor(std::sqrt(12.*variance/passes + 1.))));
+    if(w % 2 == 0)
+      --w;
+
+    //number of boxes of width w, the others have width w+2
+    int narrow = int(std::floor((12.*variance - passes*w*w - 4*passes*w - 3*passes)/(-4.*w - 4.) + 0.5));
+    narrow = std::min(std::max(narrow, 0), passes);
+
+    for(int k=0; k<passes; ++k){
+      int width = k < narrow ? w : w+2;
+      m_lo[k] = -(width/2);
+      m_hi[k] = width/2;
+    }
+
+    m_lo[0] += offset;
+    m_hi[0] += offset;
+
+    //extension of the line on each side, with one more sample after the line
+    //for the interpolation
+    m_before = 0; m_after = m_alpha > 0. ? 1 : 0;
+    for(int k=0; k<passes; ++k){
+      m_before -= m_lo[k];
+      m_after  += m_hi[k];
+    }
+  }
+
+  /**
+   * @brief size of the buffer e given to filter()
+   */
+  int buffer_size() const
+  {
+    return (m_n + m_before + m_after)*LINE_BLOCK;
+  }
+
+  /**
+   * @brief filters LINE_BLOCK lines, with the same layout as
+   *        RecursiveGaussian::filter()
+   */
+  void filter(const double* x, double* e, double* y) const
+  {
+    const int L = LINE_BLOCK;
+    int n = m_n;
+
+    //e[k] is the sample k - m_before of the mirrored line
+    int size = n + m_before + m_after;
+    for(int k=0; k<size; ++k){
+      int p = ImageT<double, PLANAR>::mirror(k - m_before, n);
+      std::copy(x + p*L, x + p*L + L, e + k*L);
+    }
+
+    //each pass replaces e[k] by the mean of e[k..k+width-1], in place
+    for(int b=0; b<m_passes; ++b){
+      int width = m_hi[b] - m_lo[b] + 1;
+      size -= width - 1;
+      if(width == 1)
+        continue;
+
+      double scale = 1./width;
+      double sum[L];
+      for(int l=0; l<L; ++l)
+        sum[l] = 0.;
+      for(int k=0; k<width; ++k)
+        for(int l=0; l<L; ++l)
+          sum[l] += e[k*L + l];
+
+      for(int k=0; k<size; ++k){
+        double* e_k = e + k*L;
+        const double* e_next = e + (k + width)*L;
+        for(int l=0; l<L; ++l){
+          double first = e_k[l];
+          e_k[l] = sum[l]*scale;
+          if(k+1 < size)
+            sum[l] += e_next[l] - first;
+        }
+      }
+    }
+
+    //fraction of the shift, e holds the n+1 filtered samples
+    if(m_alpha == 0.){
+      std::copy(e, e + n*L, y);
+      return;
+    }
+
+    for(int k=0; k<n; ++k)
+      for(int l=0; l<L; ++l)
+        y[k*L + l] = (1. - m_alpha)*e[k*L + l] + m_alpha*e[(k+1)*L + l];
+  }
+
+protected:
+  int m_n;
+  int m_passes;
+  int m_lo[MAX_BOX_PASSES];
+  int m_hi[MAX_BOX_PASSES];
+  int m_before;
+  int m_after;
+
+  //fraction of the shift, applied by a linear interpolation
+  double m_alpha;
+};
+
+/**
+ * @brief applies a 1d line filter (RecursiveGaussian or BoxCascade) to the
+ *        columns (pass 0) or rows (pass 1) of image, in place. Blocks of
+ *        LINE_BLOCK lines are gathered in a buffer of doubles, so that the
+ *        filters keep their accuracy for float images
+ */
+template<class TImage, class TFilter>
+static void filter_lines(TImage& image, int pass, const TFilter& filter)
+{
+  typedef typename TImage::Scalar Scalar;
+
+  int n     = pass == 0 ? image.height() : image.width();
+  int lines = pass == 0 ? image.width()  : image.height();
+  int blocks = (lines + LINE_BLOCK - 1)/LINE_BLOCK;
+
+  parallel_for(blocks*image.channel(), [&](int task)
+  {
+    static thread_local std::vector<double> x, e, y;
+    x.resize(n*LINE_BLOCK);
+    e.resize(filter.buffer_size());
+    y.resize(n*LINE_BLOCK);
+
+    int c  = task / blocks;
+    int l0 = (task % blocks)*LINE_BLOCK;
+    int count = std::min(LINE_BLOCK, lines - l0);
+
+    //columns are contiguous, rows are gathered pixel by pixel
+    std::fill(x.begin(), x.end(), 0.);
+    if(pass == 0){
+      for(int l=0; l<count; ++l)
+        for(int k=0; k<n; ++k)
+          x[k*LINE_BLOCK + l] = double(image.data(l0 + l, k, c));
+    }
+    else{
+      for(int k=0; k<n; ++k)
+        for(int l=0; l<count; ++l)
+          x[k*LINE_BLOCK + l] = double(image.data(k, l0 + l, c));
+    }
+
+    filter.filter(x.data(), e.data(), y.data());
+
+    if(pass == 0){
+      for(int l=0; l<count; ++l)
+        for(int k=0; k<n; ++k)
+          image.data(l0 + l, k, c) = Scalar(y[k*LINE_BLOCK + l]);
+    }
+    else{
+      for(int k=0; k<n; ++k)
+        for(int l=0; l<count; ++l)
+          image.data(k, l0 + l, c) = Scalar(y[k*LINE_BLOCK + l]);
+    }
+  });
+}
+
+/* fixed size kernels *********************************************************/
+
+/**
+ * @brief 1d filter with K taps known at compile time : out[j*out_stride] is
+ *        the sum of weights[k]*lines[k][j*stride] for k in [0, K), added in
+ *        this order as in the generic loops. Blocks of outputs are accumulated
+ *        in local variables, so the tap loop is unrolled and the block is
+ *        vectorized when the lines are contiguous.
+ */
+template<int K, typename Scalar>
+static void filter_taps(const Scalar* const* lines, const Scalar* weights, int n, int stride, Scalar* out, int out_stride)
+{
+  const int B = 8;
+
+  Scalar w[K];
+  for(int k=0; k<K; ++k)
+    w[k] = weights[k];
+
+  int j = 0;
+  if(stride == 1){
+    for(; j+B<=n; j+=B){
+      Scalar sum[B] = {};
+      for(int k=0; k<K; ++k){
+        const Scalar* line = lines[k] + j;
+        for(int b=0; b<B; ++b)
+          sum[b] += w[k]*line[b];
+      }
+
+      for(int b=0; b<B; ++b)
+        out[(j+b)*out_stride] = sum[b];
+    }
+  }
+
+  for(; j<n; ++j){
+    Scalar sum = Scalar(0);
+    for(int k=0; k<K; ++k)
+      sum += w[k]*lines[k][j*stride];
+    out[j*out_stride] = sum;
+  }
+}
+
+template<typename Scalar>
+using TapFilter = void (*)(const Scalar* const*, const Scalar*, int, int, Scalar*, int);
+
+/**
+ * @brief the filter compiled for taps, NULL if there is none. Kernels of
+ *        radius r (3, 5, 7, 9, 15 and 31) have 2r or 2r+1 taps.
+ */
+template<typename Scalar>
+static TapFilter<Scalar> tap_filter(int taps)
+{
+  switch(taps){
+  case  6: return &filter_taps< 6, Scalar>;
+  case  7: return &filter_taps< 7, Scalar>;
+  case 10: return &filter_taps<10, Scalar>;
+  case 11: return &filter_taps<11, Scalar>;
+  case 14: return &filter_taps<14, Scalar>;
+  case 15: return &filter_taps<15, Scalar>;
+  case 18: return &filter_taps<18, Scalar>;
+  case 19: return &filter_taps<19, Scalar>;
+  case 30: return &filter_taps<30, Scalar>;
+  case 31: return &filter_taps<31, Scalar>;
+  case 62: return &filter_taps<62, Scalar>;
+  case 63: return &filter_taps<63, Scalar>;
+  default: return NULL;
+  }
+}
+
 /* constructor ****************************************************************/
 
-Image::Image()
-: m_height(-1), m_width(-1), m_channel(-1)
+template<typename TScalar, int TLayout>
+ImageT<TScalar, TLayout>::ImageT()
+: m_height(-1), m_width(-1), m_channel(-1), m_data(NULL, 0, 0, Eigen::OuterStride<>(0))
 {}
 
-Image::Image(int height, int width, int channel)
-: m_height(height), m_width(width), m_channel(channel)
+template<typename TScalar, int TLayout>
+ImageT<TScalar, TLayout>::ImageT(int height, int width, int channel)
+: m_height(height), m_width(width), m_channel(channel), m_data(NULL, 0, 0, Eigen::OuterStride<>(0))
 {
   init_data(m_height, m_width, m_channel);
 }
 
-Image::Image(int height, int width, int channel, const DataType& data)
-: m_height(height), m_width(width), m_channel(channel), m_data(data)
+template<typename TScalar, int TLayout>
+ImageT<TScalar, TLayout>::ImageT(int height, int width, int channel, const DataType& data)
+: m_height(height), m_width(width), m_channel(channel), m_storage(data.data(), data.data() + data.size()), m_data(NULL, 0, 0, Eigen::OuterStride<>(0))
 {
-  assert( m_data.rows() == m_height*m_width );
+  assert( data.rows() == m_height*m_width );
+  count_allocation(0);
+  map_data(m_storage.data(), 0);
 }
 
-Image::Image(const Image& other)
-: m_height(other.m_height), m_width(other.m_width), m_channel(other.m_channel), m_data(other.m_data)
-{}
+template<typename TScalar, int TLayout>
+ImageT<TScalar, TLayout>::ImageT(const ImageT& other)
+: m_height(other.m_height), m_width(other.m_width), m_channel(other.m_channel), m_storage(other.m_data.size()), m_data(NULL, 0, 0, Eigen::OuterStride<>(0))
+{
+  count_allocation(0);
+  map_data(m_storage.data(), 0);
+  m_data = other.m_data;
+}
+
+template<typename TScalar, int TLayout>
+ImageT<TScalar, TLayout>::ImageT(ImageT&& other)
+: m_height(other.m_height), m_width(other.m_width), m_channel(other.m_channel), m_storage(std::move(other.m_storage)), m_data(NULL, 0, 0, Eigen::OuterStride<>(0))
+{
+  //the moved storage keeps its address, views keep their buffer
+  map_data(other.m_data.data(), int(other.m_data.outerStride()));
+
+  other.m_height = other.m_width = other.m_channel = -1;
+  other.map_data(NULL, 0);
+}
+
+template<typename TScalar, int TLayout>
+ImageT<TScalar, TLayout>::ImageT(int height, int width, int channel, Scalar* data, int stride)
+: m_height(height), m_width(width), m_channel(channel), m_data(NULL, 0, 0, Eigen::OuterStride<>(0))
+{
+  map_data(data, stride);
+}
+
+/* assignment *****************************************************************/
+
+template<typename TScalar, int TLayout>
+ImageT<TScalar, TLayout>&
+ImageT<TScalar, TLayout>::operator=(const ImageT& other)
+{
+  if(this == &other)
+    return *this;
+
+  resize(other.m_height, other.m_width, other.m_channel);
+  m_data = other.m_data;
+
+  return *this;
+}
+
+template<typename TScalar, int TLayout>
+ImageT<TScalar, TLayout>&
+ImageT<TScalar, TLayout>::operator=(ImageT&& other)
+{
+  if(this == &other)
+    return *this;
+
+  //views of the same size keep writing to their buffer
+  if(is_view() && m_height == other.m_height && m_width == other.m_width && m_channel == other.m_channel)
+    m_data = other.m_data;
+  else
+    swap(other);
+
+  return *this;
+}
+
+/* size ***********************************************************************/
+
+template<typename TScalar, int TLayout>
+void
+ImageT<TScalar, TLayout>::resize(int height, int width, int channel)
+{
+  if(is_valid() && height == m_height && width == m_width && channel == m_channel)
+    return;
+
+  m_height  = height;
+  m_width   = width;
+  m_channel = channel;
+
+  //the previous values are not kept, so they are not copied
+  size_t size = size_t(std::max(height*width*channel, 0));
+  if(m_storage.size() < size){
+    size_t capacity = m_storage.capacity();
+    m_storage.clear();
+    m_storage.resize(size);
+    count_allocation(capacity);
+  }
+
+  map_data(m_storage.data(), 0);
+}
 
 /* destructors ****************************************************************/
 
-Image::~Image()
+template<typename TScalar, int TLayout>
+ImageT<TScalar, TLayout>::~ImageT()
 {}
 
 /* operations *****************************************************************/
+template<typename TScalar, int TLayout>
 void
-Image::normalize()
+ImageT<TScalar, TLayout>::normalize()
 {
-  double max = m_data.maxCoeff();
+  Scalar max = m_data.maxCoeff();
   m_data /= max;
 }
 
+template<typename TScalar, int TLayout>
+void
+ImageT<TScalar, TLayout>::convolve(const ImageT& kernel, ImageT& out, BorderMode border) const
+{
+  if(FFTConvolution::is_faster(m_height, m_width, kernel.height(), kernel.width()))
+    convolve_fft(kernel, out, border);
+  else
+    convolve_direct(kernel, out, border);
+}
+
+template<typename TScalar, int TLayout>
 void
-Image::convolve(const Image& kernel, Image& out) const
-{  
-  out = Image(m_height, m_width);
+ImageT<TScalar, TLayout>::convolve_direct(const ImageT& kernel, ImageT& out, BorderMode border) const
+{
+  out.resize(m_height, m_width, m_channel);
+
+  //square kernels of the common sizes (see tap_filter()) are convolved with
+  //their size known at compile time
+  if(kernel.width() == kernel.height()){
+    switch(kernel.width()){
+    case  6: convolve_direct_taps< 6>(kernel, out, border); return;
+    case  7: convolve_direct_taps< 7>(kernel, out, border); return;
+    case 10: convolve_direct_taps<10>(kernel, out, border); return;
+    case 11: convolve_direct_taps<11>(kernel, out, border); return;
+    case 14: convolve_direct_taps<14>(kernel, out, border); return;
+    case 15: convolve_direct_taps<15>(kernel, out, border); return;
+    case 18: convolve_direct_taps<18>(kernel, out, border); return;
+    case 19: convolve_direct_taps<19>(kernel, out, border); return;
+    case 30: convolve_direct_taps<30>(kernel, out, border); return;
+    case 31: convolve_direct_taps<31>(kernel, out, border); return;
+    case 62: convolve_direct_taps<62>(kernel, out, border); return;
+    case 63: convolve_direct_taps<63>(kernel, out, border); return;
+    }
+  }
 
-  for(int i=0; i<m_width; ++i)
-    for(int j=0; j<m_height; ++j)
-      out.data().row(i*m_height+j) = convolution_kernel(i, j, kernel);
+  convolve_direct_taps<0>(kernel, out, border);
 }
 
-/* helper functions **********************************************************/
-Image::PixelType
-Image::convolution_kernel(int x, int y, const Image& kernel) const
+template<typename TScalar, int TLayout>
+template<int K>
+void
+ImageT<TScalar, TLayout>::convolve_direct_taps(const ImageT& kernel, ImageT& out, BorderMode border) const
 {
   int w_ker = kernel.width() ; int w_ker_2 = w_ker/2;
   int h_ker = kernel.height(); int h_ker_2 = h_ker/2;
 
+  //each tile reads its pixels plus a halo of half the kernel size, and
+  //writes its own pixels only
+  int n_tiles_x = (m_width  + TILE_SIZE - 1)/TILE_SIZE;
+  int n_tiles_y = (m_height + TILE_SIZE - 1)/TILE_SIZE;
+
+  parallel_for(n_tiles_x*n_tiles_y, [&](int tile)
+  {
+    int x0 = (tile / n_tiles_y) * TILE_SIZE, x1 = std::min(x0 + TILE_SIZE, m_width);
+    int y0 = (tile % n_tiles_y) * TILE_SIZE, y1 = std::min(y0 + TILE_SIZE, m_height);
+
+    //first pixel of the halo, in the image
+    int hx = x0 - w_ker_2, hy = y0 - h_ker_2;
+    int hw = x1 - x0 + w_ker - 1, hh = y1 - y0 + h_ker - 1;
+
+    //tiles whose halo crosses the border are copied with ghost pixels given
+    //by the border condition, the halo then starts at [0,0] of the copy
+    const ImageT* source = this;
+    if(hx < 0 || hy < 0 || hx + hw > m_width || hy + hh > m_height){
+      static thread_local ImageT padded;
+      padded.resize(hh, hw, m_channel);
+
+      static thread_local std::vector<int> rows;
+      rows.resize(hh);
+      for(int j=0; j<hh; ++j)
+        rows[j] = border_index(hy + j, m_height, border);
+
+      for(int i=0; i<hw; ++i){
+        int px_i = border_index(hx + i, m_width, border);
+        for(int j=0; j<hh; ++j){
+          if(px_i < 0 || rows[j] < 0)
+            padded.data().row(i*hh + j).setZero();
+          else
+            padded.data().row(i*hh + j) = data().row(px_i*m_height + rows[j]);
+        }
+      }
+
+      source = &padded;
+      hx = 0; hy = 0;
+    }
+
+    for(int i=x0; i<x1; ++i){
+      for(int j=y0; j<y1; ++j){
+        int x = hx + i - x0, y = hy + j - y0;
+        switch(m_channel){
+        case 1 : source->template convolution_kernel<1, K>(x, y, kernel, out, i, j); break;
+        case 3 : source->template convolution_kernel<3, K>(x, y, kernel, out, i, j); break;
+        case 4 : source->template convolution_kernel<4, K>(x, y, kernel, out, i, j); break;
+        default: out.data().row(i*m_height+j) = source->convolution_kernel(x, y, kernel);
+        }
+      }
+    }
+  });
+}
+
+template<typename TScalar, int TLayout>
+void
+ImageT<TScalar, TLayout>::convolve_fft(const ImageT& kernel, ImageT& out, BorderMode border) const
+{
+  static thread_local FFTConvolution engine;
+  engine.convolve(*this, kernel, out, border);
+}
+
+template<typename TScalar, int TLayout>
+void
+ImageT<TScalar, TLayout>::convolve_separable(const ImageT& kernel_x, const ImageT& kernel_y, ImageT& out,
+                                             BorderMode border) const
+{
+  assert( kernel_x.height() == 1 && kernel_y.width() == 1 );
+
+  int w_ker = kernel_x.width() ; int w_ker_2 = w_ker/2;
+  int h_ker = kernel_y.height(); int h_ker_2 = h_ker/2;
+
+  TapFilter<Scalar> filter_x = tap_filter<Scalar>(w_ker);
+  TapFilter<Scalar> filter_y = tap_filter<Scalar>(h_ker);
+
+  //the border condition is resolved once per line : source column of each
+  //tap, and source row of each sample of the padded columns (-1 for zero).
+  //The tables are kept by the calling thread, the workers use its tables
+  static thread_local std::vector<int> scratch_cols, scratch_rows;
+  std::vector<int>& cols = scratch_cols;
+  std::vector<int>& rows = scratch_rows;
+  cols.resize(m_width + w_ker - 1);
+  rows.resize(m_height + h_ker - 1);
+  for(size_t k=0; k<cols.size(); ++k)
+    cols[k] = border_index(int(k) - w_ker_2, m_width, border);
+  for(size_t j=0; j<rows.size(); ++j)
+    rows[j] = border_index(int(j) - h_ker_2, m_height, border);
+
+  //zero column for the taps outside of the image with BORDER_ZERO
+  static thread_local std::vector<Scalar> scratch_zeros;
+  std::vector<Scalar>& zeros = scratch_zeros;
+  if(border == BORDER_ZERO)
+    zeros.assign(size_t(m_height)*pixel_stride(), Scalar(0));
+
+  //horizontal pass : a column of the image is a contiguous block of rows, so
+  //each tap adds a whole (border) column weighted by the kernel value.
+  //columns are independent and are distributed among threads
+  static thread_local ImageT scratch;
+  ImageT& temp = scratch;
+  temp.resize(m_height, m_width, m_channel);
+  if(!filter_x)
+    temp.data().setZero();
+
+  parallel_for(m_width, [&](int i)
+  {
+    //fixed size kernel : the taps of each output value are summed at once
+    if(filter_x){
+      const Scalar* lines[MAX_FIXED_TAPS];
+      Scalar weights[MAX_FIXED_TAPS];
+
+      for(int c=0; c<m_channel; ++c){
+        for(int k=0; k<w_ker; ++k){
+          lines[k] = cols[i+k] < 0 ? zeros.data() : &data(cols[i+k], 0, c);
+          weights[k] = kernel_x.data(k, 0, c);
+        }
+        filter_x(lines, weights, m_height, pixel_stride(), &temp.data(i, 0, c), temp.pixel_stride());
+      }
+      return;
+    }
+
+    for(int k=0; k<w_ker; ++k){
+      int px_i = cols[i+k];
+      if(px_i < 0)
+        continue;
+
+      temp.data().middleRows(i*m_height, m_height) +=
+          data().middleRows(px_i*m_height, m_height).rowwise() * kernel_x.data().row(k);
+    }
+  });
+
+  //vertical pass : each column is padded using the border condition, then
+  //each tap adds a shifted segment of the padded column
+  out.resize(m_height, m_width, m_channel);
+  if(!filter_y)
+    out.data().setZero();
+
+  parallel_for(m_width, [&](int i)
+  {
+    static thread_local ChannelType column;
+    column.resize(m_height + h_ker - 1);
+    for(int c=0; c<m_channel; ++c){
+      for(int j=0; j<column.size(); ++j)
+        column(j) = rows[j] < 0 ? Scalar(0) : temp.data(i, rows[j], c);
+
+      if(filter_y){
+        const Scalar* lines[MAX_FIXED_TAPS];
+        Scalar weights[MAX_FIXED_TAPS];
+        for(int k=0; k<h_ker; ++k){
+          lines[k] = column.data() + k;
+          weights[k] = kernel_y.data(0, k, c);
+        }
+        filter_y(lines, weights, m_height, 1, &out.data(i, 0, c), out.pixel_stride());
+        continue;
+      }
+
+      for(int k=0; k<h_ker; ++k)
+        out.data().col(c).segment(i*m_height, m_height) += kernel_y.data(0, k, c) * column.segment(k, m_height);
+    }
+  });
+}
+
+template<typename TScalar, int TLayout>
+void
+ImageT<TScalar, TLayout>::convolve_valid(const ImageT& kernel, ImageT& out) const
+{
+  int w_ker = kernel.width();
+  int h_ker = kernel.height();
+
+  int w_out = m_width  - w_ker + 1;
+  int h_out = m_height - h_ker + 1;
+
+  //the taps are accumulated in the same order as convolution_kernel()
+  out.resize(h_out, w_out, m_channel);
+  out.data().setZero();
+  for(int i=0; i<w_out; ++i)
+    for(int k=0; k<w_ker; ++k)
+      for(int l=0; l<h_ker; ++l)
+        out.data().middleRows(i*h_out, h_out) +=
+            data().middleRows((i+k)*m_height + l, h_out).rowwise() * kernel.data().row(k*h_ker + l);
+}
+
+template<typename TScalar, int TLayout>
+void
+ImageT<TScalar, TLayout>::convolve_separable_valid(const ImageT& kernel_x, const ImageT& kernel_y, ImageT& out) const
+{
+  assert( kernel_x.height() == 1 && kernel_y.width() == 1 );
+
+  int w_ker = kernel_x.width();
+  int h_ker = kernel_y.height();
+
+  int w_out = m_width  - w_ker + 1;
+  int h_out = m_height - h_ker + 1;
+
+  //fixed size kernels, see convolve_separable()
+  TapFilter<Scalar> filter_x = tap_filter<Scalar>(w_ker);
+  TapFilter<Scalar> filter_y = tap_filter<Scalar>(h_ker);
+  const Scalar* lines[MAX_FIXED_TAPS];
+  Scalar weights[MAX_FIXED_TAPS];
+
+  //horizontal pass, on all the rows of the padded image
+  static thread_local ImageT temp;
+  temp.resize(m_height, w_out, m_channel);
+  if(filter_x){
+    for(int i=0; i<w_out; ++i)
+      for(int c=0; c<m_channel; ++c){
+        for(int k=0; k<w_ker; ++k){
+          lines[k] = &data(i+k, 0, c);
+          weights[k] = kernel_x.data(k, 0, c);
+        }
+        filter_x(lines, weights, m_height, pixel_stride(), &temp.data(i, 0, c), temp.pixel_stride());
+      }
+  }
+  else{
+    temp.data().setZero();
+    for(int i=0; i<w_out; ++i)
+      for(int k=0; k<w_ker; ++k)
+        temp.data().middleRows(i*m_height, m_height) +=
+            data().middleRows((i+k)*m_height, m_height).rowwise() * kernel_x.data().row(k);
+  }
+
+  //vertical pass
+  out.resize(h_out, w_out, m_channel);
+  if(filter_y){
+    for(int i=0; i<w_out; ++i)
+      for(int c=0; c<m_channel; ++c){
+        for(int k=0; k<h_ker; ++k){
+          lines[k] = &temp.data(i, k, c);
+          weights[k] = kernel_y.data(0, k, c);
+        }
+        filter_y(lines, weights, h_out, temp.pixel_stride(), &out.data(i, 0, c), out.pixel_stride());
+      }
+  }
+  else{
+    out.data().setZero();
+    for(int i=0; i<w_out; ++i)
+      for(int c=0; c<m_channel; ++c)
+        for(int k=0; k<h_ker; ++k)
+          out.data().col(c).segment(i*h_out, h_out) += kernel_y.data(0, k, c) * temp.data().col(c).segment(i*m_height + k, h_out);
+  }
+}
+
+template<typename TScalar, int TLayout>
+void
+ImageT<TScalar, TLayout>::convolve_recursive(double sigma_x, double sigma_y, ImageT& out,
+                                             double shift_x, double shift_y) const
+{
+  out.resize(m_height, m_width, m_channel);
+  if(&out != this)
+    out.data() = data();
+
+  //vertical pass, then horizontal pass
+  for(int pass=0; pass<2; ++pass){
+    double sigma = pass == 0 ? sigma_y : sigma_x;
+    double shift = pass == 0 ? shift_y : shift_x;
+    int n = pass == 0 ? m_height : m_width;
+
+    //the approximation is only valid for sigma >= 0.5
+    if(sigma < 0.5 && shift == 0.)
+      continue;
+
+    filter_lines(out, pass, RecursiveGaussian(sigma, n, shift));
+  }
+}
+
+template<typename TScalar, int TLayout>
+void
+ImageT<TScalar, TLayout>::convolve_box(double sigma_x, double sigma_y, int passes, ImageT& out,
+                                       double shift_x, double shift_y) const
+{
+  out.resize(m_height, m_width, m_channel);
+  if(&out != this)
+    out.data() = data();
+
+  filter_lines(out, 0, BoxCascade(sigma_y, shift_y, passes, m_height));
+  filter_lines(out, 1, BoxCascade(sigma_x, shift_x, passes, m_width));
+}
+
+/* resampling *****************************************************************/
+template<typename TScalar, int TLayout>
+void
+ImageT<TScalar, TLayout>::downsample(int factor, ImageT& out) const
+{
+  int h = (m_height + factor - 1)/factor;
+  int w = (m_width  + factor - 1)/factor;
+
+  out.resize(h, w, m_channel);
+
+  Scalar scale = Scalar(1)/Scalar(factor*factor);
+  parallel_for(w, [&](int i)
+  {
+    for(int c=0; c<m_channel; ++c){
+      for(int j=0; j<h; ++j){
+        Scalar sum = Scalar(0);
+        for(int k=0; k<factor; ++k){
+          int px_i = mirror(i*factor + k, m_width);
+
+          //only the blocks of the last row cross the border
+          if((j+1)*factor <= m_height)
+            for(int l=0; l<factor; ++l)
+              sum += data(px_i, j*factor + l, c);
+          else
+            for(int l=0; l<factor; ++l)
+              sum += data(px_i, mirror(j*factor + l, m_height), c);
+        }
+        out.data(i, j, c) = sum*scale;
+      }
+    }
+  });
+}
+
+template<typename TScalar, int TLayout>
+void
+ImageT<TScalar, TLayout>::upsample(int factor, int height, int width, ImageT& out) const
+{
+  out.resize(height, width, m_channel);
+
+  //position of the pixels of out in the image, pixel [x,y] of the image is at
+  //the center of the block [x*factor, (x+1)*factor)
+  double offset = (factor - 1)/2.;
+  auto locate = [&](int p, int size, int& p0, int& p1, Scalar& alpha)
+  {
+    double u = (p - offset)/factor;
+    double u0 = std::floor(u);
+
+    p0 = std::min(std::max(int(u0), 0), size-1);
+    p1 = std::min(std::max(int(u0) + 1, 0), size-1);
+    alpha = Scalar(u - u0);
+  };
+
+  //the rows and weights are the same for every column
+  static thread_local std::vector<int> rows;
+  static thread_local std::vector<Scalar> weights;
+  rows.resize(2*height);
+  weights.resize(height);
+  for(int j=0; j<height; ++j)
+    locate(j, m_height, rows[2*j], rows[2*j+1], weights[j]);
+
+  const int* j_p = rows.data();
+  const Scalar* b_p = weights.data();
+
+  parallel_for(width, [&](int i)
+  {
+    int i0, i1; Scalar a;
+    locate(i, m_width, i0, i1, a);
+
+    for(int c=0; c<m_channel; ++c){
+      for(int j=0; j<height; ++j){
+        int j0 = j_p[2*j], j1 = j_p[2*j+1]; Scalar b = b_p[j];
+
+        out.data(i, j, c) = (1-a)*((1-b)*data(i0, j0, c) + b*data(i0, j1, c))
+                          +    a *((1-b)*data(i1, j0, c) + b*data(i1, j1, c));
+      }
+    }
+  });
+}
+
+/**
+ * @brief weights of ImageT::resample() along one direction : sample p of out
+ *        is the sum of weight[k]*in[index[k]] for k in [first[p], first[p+1])
+ */
+struct ResamplingTaps
+{
+  std::vector<int> first;
+  std::vector<int> index;
+  std::vector<double> weight;
+
+  ResamplingTaps(int size, int out_size)
+  : first(1, 0)
+  {
+    double scale = double(size)/out_size;
+
+    for(int p=0; p<out_size; ++p){
+      if(scale > 1.){
+        //mean of the pixels overlapping [p*scale, (p+1)*scale)
+        double lo = p*scale, hi = (p+1)*scale;
+        for(int k=int(std::floor(lo)); k<std::min(int(std::ceil(hi)), size); ++k){
+          double overlap = std::min(hi, k+1.) - std::max(lo, double(k));
+          if(overlap > 0.){
+            index.push_back(k);
+            weight.push_back(overlap/scale);
+          }
+        }
+      }
+      else{
+        //linear interpolation, clamped at the border
+        double u = (p + 0.5)*scale - 0.5, u0 = std::floor(u);
+        index.push_back(std::min(std::max(int(u0), 0), size-1));
+        index.push_back(std::min(std::max(int(u0) + 1, 0), size-1));
+        weight.push_back(1. - (u - u0));
+        weight.push_back(u - u0);
+      }
+      first.push_back(int(index.size()));
+    }
+  }
+};
+
+template<typename TScalar, int TLayout>
+void
+ImageT<TScalar, TLayout>::resample(int height, int width, ImageT& out) const
+{
+  ResamplingTaps taps_y(m_height, height);
+  ResamplingTaps taps_x(m_width, width);
+
+  //vertical pass, column by column
+  static thread_local ImageT scratch;
+  ImageT& temp = scratch;
+  temp.resize(height, m_width, m_channel);
+
+  parallel_for(m_width, [&](int i)
+  {
+    for(int c=0; c<m_channel; ++c)
+      for(int j=0; j<height; ++j){
+        Scalar sum = Scalar(0);
+        for(int k=taps_y.first[j]; k<taps_y.first[j+1]; ++k)
+          sum += Scalar(taps_y.weight[k])*data(i, taps_y.index[k], c);
+        temp.data(i, j, c) = sum;
+      }
+  });
+
+  //horizontal pass, each tap adds a whole column
+  out.resize(height, width, m_channel);
+  parallel_for(width, [&](int i)
+  {
+    out.data().middleRows(i*height, height).setZero();
+    for(int k=taps_x.first[i]; k<taps_x.first[i+1]; ++k)
+      out.data().middleRows(i*height, height) += Scalar(taps_x.weight[k])*temp.data().middleRows(taps_x.index[k]*height, height);
+  });
+}
+
+/* helper functions **********************************************************/
+template<typename TScalar, int TLayout>
+typename ImageT<TScalar, TLayout>::PixelType
+ImageT<TScalar, TLayout>::convolution_kernel(int x, int y, const ImageT& kernel) const
+{
+  int w_ker = kernel.width();
+  int h_ker = kernel.height();
+
   PixelType sum = PixelType::Zero(m_channel);
   for(int i=0; i<w_ker; ++i){
     for(int j=0; j<h_ker; ++j){
-      int px_i = x - w_ker_2 + i;
-      int px_j = y - h_ker_2 + j;
+      //get pixel value and add
+      sum += data().row((x + i)*m_height + y + j) * kernel.data().row(i*h_ker + j);
+    }
+  }
 
-      //use mirror border condition
-      if(px_i < 0)
-        px_i = (-px_i) - 1;
-      if(px_j < 0)
-        px_j = (-px_j) - 1;
+  return sum;
+}
 
-      if(px_i >= m_width)
-        px_i = (m_width-1) - (px_i-m_width);
-      if(px_j >= m_height)
-        px_j = (m_height-1) - (px_j-m_height);
+template<typename TScalar, int TLayout>
+template<int C, int K>
+void
+ImageT<TScalar, TLayout>::convolution_kernel(int x, int y, const ImageT& kernel, ImageT& out, int out_x, int out_y) const
+{
+  int w_ker = K > 0 ? K : kernel.width();
+  int h_ker = K > 0 ? K : kernel.height();
 
+  //memory offsets of the pixels and channels, they depend on the layout
+  int p_stride = pixel_stride(), ker_p_stride = kernel.pixel_stride();
+  int c_stride = channel_stride(), ker_c_stride = kernel.channel_stride();
+
+  const Scalar* pixels = m_data.data();
+  const Scalar* values = kernel.data().data();
+
+  Scalar sum[C];
+  for(int c=0; c<C; ++c)
+    sum[c] = Scalar(0);
+
+  for(int i=0; i<w_ker; ++i){
+    const Scalar* column = pixels + ((x + i)*m_height + y)*p_stride;
+
+    for(int j=0; j<h_ker; ++j){
       //get pixel value and add
-      sum += data().row(px_i*m_height + px_j) * kernel.data().row(i*h_ker + j);
+      const Scalar* pixel = column + j*p_stride;
+      const Scalar* value = values + (i*h_ker + j)*ker_p_stride;
+      for(int c=0; c<C; ++c)
+        sum[c] += pixel[c*c_stride] * value[c*ker_c_stride];
     }
   }
 
-  return sum;
+  for(int c=0; c<C; ++c)
+    out.data(out_x, out_y, c) = sum[c];
 }
+
+/* explicit instantiations ****************************************************/
+template class ImageT<double, PLANAR>;
+template class ImageT<double, INTERLEAVED>;
+template class ImageT<float , PLANAR>;
+template class ImageT<float , INTERLEAVED>;
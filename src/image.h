@@ -2,30 +2,113 @@
 #define IMAGE_H
 
 #include <assert.h>
+#include <algorithm>
+#include <new>
+#include <utility>
 #include <vector>
 
 #include <Eigen/Core>
 
+/**
+ * @brief memory layouts of the image data, a (height*width) x channel array:
+ *          - PLANAR : each channel is stored as a contiguous plane
+ *          - INTERLEAVED : the channels of a pixel are contiguous
+ */
+enum ImageLayout
+{
+  PLANAR      = Eigen::ColMajor,
+  INTERLEAVED = Eigen::RowMajor
+};
+
+/**
+ * @brief values of the pixels outside of the image for the convolutions :
+ *          - BORDER_MIRROR : the image is reflected, the border pixel being
+ *            repeated (see ImageT::mirror())
+ *          - BORDER_CLAMP : the nearest border pixel
+ *          - BORDER_WRAP : the image is periodic
+ *          - BORDER_ZERO : 0
+ */
+enum BorderMode
+{
+  BORDER_MIRROR,
+  BORDER_CLAMP,
+  BORDER_WRAP,
+  BORDER_ZERO
+};
+
+/**
+ * @brief total number of bytes allocated for the data of the images (of any
+ *        type) since the start of the program. Views do not allocate.
+ */
+unsigned long long image_allocated_bytes();
+
+/**
+ * @brief same as image_allocated_bytes(), restricted to the calling thread and
+ *        to the threads of the pool while they run the tasks of its
+ *        parallel_for loops (see current_account())
+ */
+unsigned long long thread_image_allocated_bytes();
+
+/**
+ * @brief adds bytes to image_allocated_bytes() and to the account of the
+ *        current thread, called by the images
+ */
+void count_image_allocation(size_t bytes);
+
 /**
  * @brief Minimal Image class
+ *        takes two template parameters:
+ *          - TScalar is the type of the stored values (float or double)
+ *          - TLayout is the memory layout of the data (see ImageLayout)
+ *
+ *        An image either owns its data or is a view of an external buffer
+ *        (see the corresponding constructor). In both cases data() is an
+ *        Eigen::Map of the values, whose outer stride is the distance between
+ *        two channels (PLANAR) or two pixels (INTERLEAVED).
+ *
+ *        Copying an image (copy constructor) always creates an image that owns
+ *        its data, moving an image takes its data. Assigning an image to a view
+ *        of the same size copies the values in the buffer of the view,
+ *        otherwise the image owns its data, reusing its memory when it is large
+ *        enough (see resize()).
  */
-class Image
+template<typename TScalar, int TLayout=PLANAR>
+class ImageT
 {
 public:
   /* internal types ***********************************************************/
-  typedef Eigen::Array<double, Eigen::Dynamic, Eigen::Dynamic>  DataType;
-  typedef Eigen::Array<double, Eigen::Dynamic, 1           > ChannelType;
-  typedef Eigen::Array<double, 1             , Eigen::Dynamic> PixelType;
+  typedef TScalar Scalar;
+  enum { Layout = TLayout };
+
+  typedef Eigen::Array<Scalar, Eigen::Dynamic, Eigen::Dynamic, TLayout>  DataType;
+  typedef Eigen::Array<Scalar, Eigen::Dynamic, 1                      > ChannelType;
+  typedef Eigen::Array<Scalar, 1             , Eigen::Dynamic         > PixelType;
+
+  typedef Eigen::Map<DataType, Eigen::Unaligned, Eigen::OuterStride<> > MapType;
 
 public:
   /* contructors **************************************************************/
-  Image();
-  Image(int height, int width, int channel=3);
-  Image(int height, int width, int channel, const DataType& data);
-  Image(const Image& other);
+  ImageT();
+  ImageT(int height, int width, int channel=3);
+  ImageT(int height, int width, int channel, const DataType& data);
+  ImageT(const ImageT& other);
+  ImageT(ImageT&& other);
+
+  /**
+   * @brief creates a view of an external buffer, which is neither copied nor
+   *        freed : it must outlive the image.
+   * @param data is the first value of the buffer, stored with the layout of
+   *        the image
+   * @param stride is the distance in memory between two channels (PLANAR) or
+   *        two pixels (INTERLEAVED), 0 for a packed buffer
+   */
+  ImageT(int height, int width, int channel, Scalar* data, int stride=0);
+
+  ImageT& operator=(const ImageT& other);
+  ImageT& operator=(ImageT&& other);
 
   /* destructors **************************************************************/
-  virtual ~Image();
+  virtual ~ImageT();
 
   /* access image properties **************************************************/
   inline int height() const
@@ -48,23 +131,56 @@ public:
     return m_data.rows() > 0;
   }
 
+  /**
+   * @brief true if the image is a view of an external buffer
+   */
+  inline bool is_view() const
+  {
+    return m_data.data() != NULL && m_data.data() != m_storage.data();
+  }
+
+  /**
+   * @brief true if there is no gap between the channels (PLANAR) or the
+   *        pixels (INTERLEAVED), i.e. the data is a single block of memory
+   */
+  inline bool is_contiguous() const
+  {
+    return m_data.outerStride() == m_data.innerSize();
+  }
+
+  /**
+   * @brief distance in memory between two consecutive pixels of a channel
+   */
+  inline int pixel_stride() const
+  {
+    return TLayout == PLANAR ? 1 : int(m_data.outerStride());
+  }
+
+  /**
+   * @brief distance in memory between two consecutive channels of a pixel
+   */
+  inline int channel_stride() const
+  {
+    return TLayout == PLANAR ? int(m_data.outerStride()) : 1;
+  }
+
   /* access image data ********************************************************/
-  inline DataType& data()
+  inline MapType& data()
   {
     return m_data;
   }
 
-  inline const DataType& data() const
+  inline const MapType& data() const
   {
     return m_data;
   }
 
-  inline double& data(int i, int j, int channel)
+  inline Scalar& data(int i, int j, int channel)
   {
     return m_data(i*m_height+j, channel);
   }
 
-  inline const double& data(int i, int j, int channel) const
+  inline const Scalar& data(int i, int j, int channel) const
   {
     return m_data(i*m_height+j, channel);
   }
@@ -75,11 +191,38 @@ public:
    * @param j is the jth row
    * @param value is the pixel value
    */
-  inline void set_pixel(int i, int j, double value)
+  inline void set_pixel(int i, int j, Scalar value)
   {
     m_data.row(i*m_height+j) = PixelType::Ones(m_channel)*value;
   }
 
+  /**
+   * @brief exchanges the size and data of two images, without copying the data
+   *        (views stay views of the same buffer)
+   */
+  inline void swap(ImageT& other)
+  {
+    Scalar* data = m_data.data();
+    int stride = int(m_data.outerStride());
+
+    std::swap(m_height , other.m_height);
+    std::swap(m_width  , other.m_width);
+    std::swap(m_channel, other.m_channel);
+    m_storage.swap(other.m_storage);
+
+    map_data(other.m_data.data(), int(other.m_data.outerStride()));
+    other.map_data(data, stride);
+  }
+
+  /**
+   * @brief changes the size of the image. Nothing is done if the size does not
+   *        change, otherwise the image owns its data and its memory is only
+   *        reallocated when it is too small : buffers can be reused from one
+   *        call (or frame) to the next without allocation.
+   *        The values are not initialised.
+   */
+  void resize(int height, int width, int channel);
+
   /* operations ***************************************************************/
   /**
    * @brief normalizes the values between 0 and 1
@@ -88,11 +231,154 @@ public:
 
   /**
    * @brief performes a convolution operation with kernel.
-   *        Mirror boundary conditions are implemented..
+   *        Mirror boundary conditions are implemented by default, see
+   *        BorderMode for the others.
+   *        Uses convolve_fft() or convolve_direct() depending on the kernel
+   *        size.
    * @param kernel is the convolution kernel
    * @param out is the resuting image
    */
-  void convolve(const Image& kernel, Image& out) const;
+  void convolve(const ImageT& kernel, ImageT& out, BorderMode border=BORDER_MIRROR) const;
+
+  /**
+   * @brief same as convolve(), computed in the spatial domain.
+   *        Square kernels of radius 3, 5, 7, 9, 15 and 31 (2r or 2r+1 taps)
+   *        are convolved with loops compiled for their size.
+   *        The tiles whose neighbourhood is inside the image are convolved in
+   *        place, the others are first copied with their neighbourhood
+   *        completed by the border condition, so the tap loops never test the
+   *        border and all the border modes have the same cost.
+   */
+  void convolve_direct(const ImageT& kernel, ImageT& out, BorderMode border=BORDER_MIRROR) const;
+
+  /**
+   * @brief same as convolve(), computed in the frequency domain.
+   *        The kernel spectrum is cached (per thread) and reused as long as
+   *        the kernel and the image size do not change.
+   */
+  void convolve_fft(const ImageT& kernel, ImageT& out, BorderMode border=BORDER_MIRROR) const;
+
+  /**
+   * @brief performes a separable convolution operation, i.e. a convolution
+   *        with the kernel kernel_x*kernel_y, as two 1d passes.
+   *        Mirror boundary conditions are implemented by default, see
+   *        BorderMode for the others.
+   *        As for convolve_direct(), the passes whose kernel has a radius of
+   *        3, 5, 7, 9, 15 or 31 use loops compiled for their size, each output
+   *        value being accumulated in registers. The taps are added in the same
+   *        order, so the results do not depend on the kernel size being
+   *        specialized or not.
+   * @param kernel_x is the horizontal kernel (an image of height 1)
+   * @param kernel_y is the vertical kernel (an image of width 1)
+   * @param out is the resuting image
+   */
+  void convolve_separable(const ImageT& kernel_x, const ImageT& kernel_y, ImageT& out,
+                          BorderMode border=BORDER_MIRROR) const;
+
+  /**
+   * @brief performes a convolution operation without border conditions : the
+   *        image is expected to be padded by the kernel size, out has size
+   *        (height-kernel.height()+1) x (width-kernel.width()+1).
+   *        Pixel [x,y] of out is equal to pixel [x+w/2,y+h/2] of convolve()
+   *        applied to the unpadded image (w, h being the kernel size).
+   * @param kernel is the convolution kernel
+   * @param out is the resuting image
+   */
+  void convolve_valid(const ImageT& kernel, ImageT& out) const;
+
+  /**
+   * @brief same as convolve_valid() for a separable kernel, see
+   *        convolve_separable().
+   */
+  void convolve_separable_valid(const ImageT& kernel_x, const ImageT& kernel_y, ImageT& out) const;
+
+  /**
+   * @brief approximates the convolution with a gaussian of standard deviations
+   *        sigma_x and sigma_y (in pixels) by recursive (IIR) filters in each
+   *        direction, at a cost per pixel that is bounded independently of
+   *        sigma.
+   *        The filter is an untruncated gaussian : to approximate a truncated
+   *        kernel, sigma must be the standard deviation of the kernel (as in
+   *        BasePSF::convolve()). The mirror boundary conditions are
+   *        implemented. Directions with a sigma below 0.5 are not filtered.
+   *        shift_x and shift_y move the center of the gaussian as in
+   *        convolve_box(), the fractional part by a linear interpolation.
+   *        out may be the image itself.
+   */
+  void convolve_recursive(double sigma_x, double sigma_y, ImageT& out,
+                          double shift_x=0., double shift_y=0.) const;
+
+  /**
+   * @brief approximates the convolution with a gaussian of standard deviations
+   *        sigma_x and sigma_y (in pixels) by a cascade of passes box filters
+   *        in each direction (at least 3 for a near gaussian, at most 8),
+   *        computed with running sums at a cost per pixel that does not depend
+   *        on sigma.
+   *        shift_x and shift_y move the center of the gaussian, out(x) being a
+   *        weighted mean of the pixels around x + shift : the whole part by
+   *        the first box, the fractional part by a linear interpolation.
+   *        The mirror boundary conditions are implemented.
+   *        out may be the image itself.
+   */
+  void convolve_box(double sigma_x, double sigma_y, int passes, ImageT& out,
+                    double shift_x=0., double shift_y=0.) const;
+
+  /* resampling ***************************************************************/
+  /**
+   * @brief reduces the image by factor : each pixel of out is the mean of a
+   *        block of factor x factor pixels. Blocks crossing the border are
+   *        completed with the mirror border condition.
+   *        out has size ceil(height/factor) x ceil(width/factor).
+   */
+  void downsample(int factor, ImageT& out) const;
+
+  /**
+   * @brief inverse of downsample() : out (of size height x width) is the
+   *        bilinear interpolation of the image, whose pixels are at the center
+   *        of the blocks of factor x factor pixels of out.
+   */
+  void upsample(int factor, int height, int width, ImageT& out) const;
+
+  /**
+   * @brief resamples the image to height x width for any ratio, both images
+   *        covering the same area. Along each direction that is reduced, a
+   *        pixel of out is the mean of the pixels it covers (weighted by their
+   *        overlap). Along the others, it is the linear interpolation of the
+   *        two nearest pixels, the pixel centers being aligned as in
+   *        upsample() : pixel p of out is at (p + 1/2)*size/out_size - 1/2.
+   */
+  void resample(int height, int width, ImageT& out) const;
+
+  /* border conditions ********************************************************/
+  /**
+   * @brief maps a coordinate outside of [0, size-1] back inside the image
+   *        using the mirror border condition.
+   */
+  static inline int mirror(int p, int size)
+  {
+    //loop for kernels larger than the image
+    while(p < 0 || p >= size){
+      if(p < 0)
+        p = (-p) - 1;
+      if(p >= size)
+        p = (size-1) - (p-size);
+    }
+    return p;
+  }
+
+  /**
+   * @brief maps a coordinate outside of [0, size-1] back inside the image
+   *        using the border condition, returns -1 for BORDER_ZERO
+   */
+  static inline int border_index(int p, int size, BorderMode border)
+  {
+    switch(border){
+    case BORDER_CLAMP: return std::min(std::max(p, 0), size-1);
+    case BORDER_WRAP : return ((p % size) + size) % size;
+    case BORDER_ZERO : return p < 0 || p >= size ? -1 : p;
+    default          : return mirror(p, size);
+    }
+  }
 
 protected:
   /* initialisation ***********************************************************/
@@ -101,16 +387,66 @@ protected:
    */
   inline void init_data(int height, int width, int channel=3)
   {
-    m_data.resize(height*width, channel);
-    m_data.setZero();
+    size_t capacity = m_storage.capacity();
+    m_storage.assign(size_t(std::max(height*width*channel, 0)), Scalar(0));
+    count_allocation(capacity);
+    map_data(m_storage.data(), 0);
+  }
+
+  /**
+   * @brief counts the storage as allocated if its capacity changed
+   */
+  inline void count_allocation(size_t capacity)
+  {
+    if(m_storage.capacity() != capacity)
+      count_image_allocation(m_storage.capacity()*sizeof(Scalar));
+  }
+
+  /**
+   * @brief points m_data to data, using the current image size
+   * @param stride is the outer stride, 0 for a packed buffer
+   */
+  inline void map_data(Scalar* data, int stride)
+  {
+    //invalid images have no data
+    if(data == NULL || m_height <= 0 || m_width <= 0 || m_channel <= 0){
+      new (&m_data) MapType(NULL, 0, 0, Eigen::OuterStride<>(0));
+      return;
+    }
+
+    int rows = m_height*m_width;
+    if(stride == 0)
+      stride = TLayout == PLANAR ? rows : m_channel;
+
+    new (&m_data) MapType(data, rows, m_channel, Eigen::OuterStride<>(stride));
   }
 
   /* helper functions *********************************************************/
   /**
    * @brief a helper function for the convolution operation. its goal is to make
    *        the code easier to read.
+   *        Sums the kernel times the pixels of the window whose first pixel is
+   *        [x,y], the window must be inside the image (there is no border
+   *        condition).
    */
-  PixelType convolution_kernel(int x, int y, const Image& kernel) const;
+  PixelType convolution_kernel(int x, int y, const ImageT& kernel) const;
+
+  /**
+   * @brief same as convolution_kernel() for a number of channels C known at
+   *        compile time. The sums are kept in local variables (no temporary
+   *        pixel is allocated) and written to pixel [out_x,out_y] of out.
+   *        K is the size of a square kernel when it is known at compile time
+   *        (the tap loops are unrolled), 0 otherwise.
+   */
+  template<int C, int K>
+  void convolution_kernel(int x, int y, const ImageT& kernel, ImageT& out, int out_x, int out_y) const;
+
+  /**
+   * @brief convolve_direct() for a square kernel of size K, or any kernel if
+   *        K is 0
+   */
+  template<int K>
+  void convolve_direct_taps(const ImageT& kernel, ImageT& out, BorderMode border) const;
 
 private:
   /* image size ***************************************************************/
@@ -119,7 +455,12 @@ private:
   int m_channel;
 
   /* image data ***************************************************************/
-  DataType m_data;
+  std::vector<Scalar> m_storage; //unused by views
+  MapType  m_data;
 };
 
+/* common image types *********************************************************/
+typedef ImageT<double, PLANAR> Image;
+typedef ImageT<float , PLANAR> ImageF;
+
 #endif //IMAGE_H
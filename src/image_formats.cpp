@@ -0,0 +1,575 @@
+#include "image_formats.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+#ifdef HDR_USE_ZLIB
+#include <zlib.h>
+#endif
+
+/* helper functions ***********************************************************/
+
+/**
+ * @brief reads the whole content of a file
+ */
+static bool read_file(const std::string& filename, std::vector<unsigned char>& bytes)
+{
+  std::FILE* file = std::fopen(filename.c_str(), "rb");
+  if(!file)
+    return false;
+
+  std::fseek(file, 0, SEEK_END);
+  long size = std::ftell(file);
+  std::fseek(file, 0, SEEK_SET);
+
+  bytes.resize(size > 0 ? size : 0);
+  bool success = size > 0 && std::fread(&bytes[0], 1, bytes.size(), file) == bytes.size();
+  std::fclose(file);
+
+  return success;
+}
+
+/**
+ * @brief reads a whitespace separated token of a text header, starting at
+ *        pos. pos is moved after the token.
+ */
+static std::string read_token(const std::vector<unsigned char>& bytes, size_t& pos)
+{
+  while(pos < bytes.size() && std::isspace(bytes[pos]))
+    ++pos;
+
+  std::string token;
+  while(pos < bytes.size() && !std::isspace(bytes[pos]))
+    token.push_back(char(bytes[pos++]));
+
+  return token;
+}
+
+/**
+ * @brief reads a null-terminated string starting at pos. pos is moved after
+ *        the terminating null character.
+ */
+static std::string read_string(const std::vector<unsigned char>& bytes, size_t& pos)
+{
+  std::string text;
+  while(pos < bytes.size() && bytes[pos] != 0)
+    text.push_back(char(bytes[pos++]));
+  ++pos;
+
+  return text;
+}
+
+/**
+ * @brief reads a line of a text header, starting at pos. pos is moved after
+ *        the end of line.
+ */
+static std::string read_line(const std::vector<unsigned char>& bytes, size_t& pos)
+{
+  std::string line;
+  while(pos < bytes.size() && bytes[pos] != '\n')
+    line.push_back(char(bytes[pos++]));
+  ++pos;
+
+  return line;
+}
+
+/**
+ * @brief little endian integers and floats
+ */
+static inline uint32_t read_uint32(const unsigned char* p)
+{
+  return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+}
+
+static inline uint64_t read_uint64(const unsigned char* p)
+{
+  return uint64_t(read_uint32(p)) | (uint64_t(read_uint32(p+4)) << 32);
+}
+
+static inline float read_float(const unsigned char* p)
+{
+  uint32_t bits = read_uint32(p);
+  float value;
+  std::memcpy(&value, &bits, sizeof(float));
+  return value;
+}
+
+/**
+ * @brief converts a half precision float to single precision
+ */
+static inline float read_half(const unsigned char* p)
+{
+  uint32_t half = uint32_t(p[0]) | (uint32_t(p[1]) << 8);
+
+  uint32_t sign     = (half & 0x8000) << 16;
+  uint32_t exponent = (half >> 10) & 0x1f;
+  uint32_t mantissa = half & 0x3ff;
+
+  uint32_t bits;
+  if(exponent == 0){
+    if(mantissa == 0)
+      bits = sign;
+    else{
+      //subnormal half, normal float
+      exponent = 127 - 15 + 1;
+      while(!(mantissa & 0x400)){
+        mantissa <<= 1;
+        --exponent;
+      }
+      bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+    }
+  }
+  else if(exponent == 31)
+    bits = sign | 0x7f800000 | (mantissa << 13);
+  else
+    bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+
+  float value;
+  std::memcpy(&value, &bits, sizeof(float));
+  return value;
+}
+
+/* PFM ************************************************************************/
+
+template<class TImage>
+bool read_pfm(TImage& image, const std::string& filename)
+{
+  typedef typename TImage::Scalar Scalar;
+
+  std::vector<unsigned char> bytes;
+  if(!read_file(filename, bytes))
+    return false;
+
+  size_t pos = 0;
+  std::string type = read_token(bytes, pos);
+  int width  = std::atoi(read_token(bytes, pos).c_str());
+  int height = std::atoi(read_token(bytes, pos).c_str());
+  double scale = std::atof(read_token(bytes, pos).c_str());
+  ++pos; //single whitespace before the raster
+
+  int channel = type == "PF" ? 3 : (type == "Pf" ? 1 : 0);
+  if(channel == 0 || width <= 0 || height <= 0 || scale == 0.)
+    return false;
+
+  size_t row_size = size_t(width)*channel*sizeof(float);
+  if(bytes.size() < pos + row_size*height)
+    return false;
+
+  //a negative scale means little endian values
+  bool swap = scale > 0.;
+
+  //rows are stored from bottom to top
+  TImage result(height, width, channel);
+  for(int r=0; r<height; ++r){
+    int j = height - 1 - r;
+    unsigned char* row = &bytes[pos + r*row_size];
+
+    for(int i=0; i<width; ++i){
+      for(int c=0; c<channel; ++c){
+        unsigned char* value = row + (i*channel + c)*sizeof(float);
+        if(swap){
+          std::swap(value[0], value[3]);
+          std::swap(value[1], value[2]);
+        }
+        result.data(i, j, c) = Scalar(read_float(value));
+      }
+    }
+  }
+
+  image = std::move(result);
+  return true;
+}
+
+/* Radiance RGBE **************************************************************/
+
+/**
+ * @brief decodes a scanline of width rgbe pixels starting at pos, in the new
+ *        run-length encoding, the old one or without encoding. pos is moved
+ *        after the scanline.
+ */
+static bool read_rgbe_scanline(const std::vector<unsigned char>& bytes, size_t& pos, int width,
+                               std::vector<unsigned char>& scanline)
+{
+  size_t size = bytes.size();
+  if(pos + 4 > size)
+    return false;
+
+  //new run-length encoding : 2, 2, width (2 bytes) then each component
+  //separately, as runs (count > 128) or literal sequences
+  if(width >= 8 && width < 32768 && bytes[pos] == 2 && bytes[pos+1] == 2 && !(bytes[pos+2] & 0x80)){
+    if(((bytes[pos+2] << 8) | bytes[pos+3]) != width)
+      return false;
+    pos += 4;
+
+    for(int k=0; k<4; ++k){
+      int i = 0;
+      while(i < width){
+        if(pos >= size)
+          return false;
+
+        int count = bytes[pos++];
+        if(count > 128){
+          count -= 128;
+          if(pos >= size || i + count > width)
+            return false;
+
+          unsigned char value = bytes[pos++];
+          for(; count>0; --count)
+            scanline[4*(i++) + k] = value;
+        }
+        else{
+          if(count == 0 || pos + count > size || i + count > width)
+            return false;
+
+          for(; count>0; --count)
+            scanline[4*(i++) + k] = bytes[pos++];
+        }
+      }
+    }
+    return true;
+  }
+
+  //flat pixels, where (1, 1, 1, n) repeats the previous pixel (old encoding)
+  int shift = 0;
+  int i = 0;
+  while(i < width){
+    if(pos + 4 > size)
+      return false;
+
+    const unsigned char* pixel = &bytes[pos];
+    pos += 4;
+
+    if(pixel[0] == 1 && pixel[1] == 1 && pixel[2] == 1){
+      int count = int(pixel[3]) << shift;
+      if(i == 0 || i + count > width)
+        return false;
+
+      for(; count>0; --count, ++i)
+        std::memcpy(&scanline[4*i], &scanline[4*(i-1)], 4);
+      shift += 8;
+    }
+    else{
+      std::memcpy(&scanline[4*(i++)], pixel, 4);
+      shift = 0;
+    }
+  }
+  return true;
+}
+
+template<class TImage>
+bool read_rgbe(TImage& image, const std::string& filename)
+{
+  typedef typename TImage::Scalar Scalar;
+
+  std::vector<unsigned char> bytes;
+  if(!read_file(filename, bytes))
+    return false;
+
+  //header : "#?" program name, variables and an empty line
+  size_t pos = 0;
+  if(read_line(bytes, pos).compare(0, 2, "#?") != 0)
+    return false;
+
+  for(std::string line=read_line(bytes, pos); !line.empty(); line=read_line(bytes, pos)){
+    if(pos >= bytes.size())
+      return false;
+    if(line.compare(0, 7, "FORMAT=") == 0 && line != "FORMAT=32-bit_rle_rgbe")
+      return false;
+  }
+
+  //resolution, only the standard orientation is supported
+  if(read_token(bytes, pos) != "-Y")
+    return false;
+  int height = std::atoi(read_token(bytes, pos).c_str());
+  if(read_token(bytes, pos) != "+X")
+    return false;
+  int width  = std::atoi(read_token(bytes, pos).c_str());
+  read_line(bytes, pos);
+
+  if(width <= 0 || height <= 0)
+    return false;
+
+  TImage result(height, width, 3);
+  std::vector<unsigned char> scanline(4*width);
+  for(int j=0; j<height; ++j){
+    if(!read_rgbe_scanline(bytes, pos, width, scanline))
+      return false;
+
+    for(int i=0; i<width; ++i){
+      const unsigned char* rgbe = &scanline[4*i];
+      if(rgbe[3] == 0)
+        continue;
+
+      //values are at the center of their quantization interval
+      double f = std::ldexp(1., int(rgbe[3]) - (128+8));
+      for(int c=0; c<3; ++c)
+        result.data(i, j, c) = Scalar((rgbe[c] + 0.5)*f);
+    }
+  }
+
+  image = std::move(result);
+  return true;
+}
+
+/* OpenEXR ********************************************************************/
+
+enum ExrCompression
+{
+  EXR_NO_COMPRESSION   = 0,
+  EXR_ZIPS_COMPRESSION = 2,
+  EXR_ZIP_COMPRESSION  = 3
+};
+
+enum ExrPixelType
+{
+  EXR_UINT  = 0,
+  EXR_HALF  = 1,
+  EXR_FLOAT = 2
+};
+
+struct ExrChannel
+{
+  std::string name;
+  int type;
+  int size;   //bytes per value
+  int target; //channel of the image, -1 if the channel is ignored
+};
+
+/**
+ * @brief undoes the ZIP compression of a block : zlib, then the byte
+ *        predictor and the split of the bytes in two halves.
+ */
+static bool exr_unzip(const unsigned char* in, size_t in_size, std::vector<unsigned char>& out,
+                      std::vector<unsigned char>& buffer)
+{
+#ifdef HDR_USE_ZLIB
+  buffer.resize(out.size());
+  uLongf size = uLongf(buffer.size());
+  if(uncompress(&buffer[0], &size, in, uLong(in_size)) != Z_OK || size != buffer.size())
+    return false;
+
+  for(size_t k=1; k<buffer.size(); ++k)
+    buffer[k] = (unsigned char)(int(buffer[k-1]) + int(buffer[k]) - 128);
+
+  size_t half = (buffer.size() + 1)/2;
+  for(size_t k=0; k<out.size(); ++k)
+    out[k] = (k % 2 == 0) ? buffer[k/2] : buffer[half + k/2];
+
+  return true;
+#else
+  (void) in; (void) in_size; (void) out; (void) buffer;
+  return false;
+#endif
+}
+
+template<class TImage>
+bool read_exr(TImage& image, const std::string& filename)
+{
+  typedef typename TImage::Scalar Scalar;
+
+  std::vector<unsigned char> bytes;
+  if(!read_file(filename, bytes))
+    return false;
+
+  //magic number and version, tiled, deep and multi-part files are not supported
+  size_t size = bytes.size();
+  if(size < 8 || read_uint32(&bytes[0]) != 20000630 || bytes[4] != 2 || (bytes[5] & 0x1a))
+    return false;
+
+  //header : a list of attributes (name, type, size, value) ending with an
+  //empty name
+  std::vector<ExrChannel> channels;
+  int compression = -1;
+  int x_min = 0, y_min = 0, x_max = -1, y_max = -1;
+
+  size_t pos = 8;
+  while(true){
+    std::string name = read_string(bytes, pos);
+    if(name.empty())
+      break;
+
+    std::string type = read_string(bytes, pos);
+    if(pos + 4 > size)
+      return false;
+
+    size_t value = pos + 4;
+    size_t length = read_uint32(&bytes[pos]);
+    pos = value + length;
+    if(pos > size)
+      return false;
+
+    if(name == "channels" && type == "chlist"){
+      //name, pixel type, linear flag + 3 reserved bytes, x and y sampling
+      size_t p = value;
+      while(p < pos && bytes[p] != 0){
+        ExrChannel channel;
+        channel.name = read_string(bytes, p);
+        if(p + 16 > pos)
+          return false;
+
+        channel.type = int(read_uint32(&bytes[p]));
+        channel.size = channel.type == EXR_HALF ? 2 : 4;
+        channel.target = -1;
+        if(channel.type < EXR_UINT || channel.type > EXR_FLOAT ||
+           read_uint32(&bytes[p+8]) != 1 || read_uint32(&bytes[p+12]) != 1)
+          return false;
+
+        channels.push_back(channel);
+        p += 16;
+      }
+    }
+    else if(name == "compression" && length == 1)
+      compression = bytes[value];
+    else if(name == "dataWindow" && length == 16){
+      x_min = int(read_uint32(&bytes[value]));
+      y_min = int(read_uint32(&bytes[value+4]));
+      x_max = int(read_uint32(&bytes[value+8]));
+      y_max = int(read_uint32(&bytes[value+12]));
+    }
+  }
+  if(pos > size)
+    return false;
+
+  int width  = x_max - x_min + 1;
+  int height = y_max - y_min + 1;
+  if(width <= 0 || height <= 0 || channels.empty())
+    return false;
+
+  int lines;
+  switch(compression){
+  case EXR_NO_COMPRESSION  : lines = 1 ; break;
+  case EXR_ZIPS_COMPRESSION: lines = 1 ; break;
+  case EXR_ZIP_COMPRESSION : lines = 16; break;
+  default: return false;
+  }
+
+  //channels are stored in alphabetical order, the image gets R, G and B, or
+  //Y alone
+  const char* rgb[3] = { "R", "G", "B" };
+  int n_channels = 0;
+  for(int c=0; c<3; ++c)
+    for(size_t k=0; k<channels.size(); ++k)
+      if(channels[k].name == rgb[c])
+        channels[k].target = n_channels++;
+
+  if(n_channels != 3){
+    n_channels = 0;
+    for(size_t k=0; k<channels.size(); ++k)
+      channels[k].target = channels[k].name == "Y" ? n_channels++ : -1;
+  }
+  if(n_channels != 1 && n_channels != 3)
+    return false;
+
+  size_t line_size = 0;
+  for(size_t k=0; k<channels.size(); ++k)
+    line_size += size_t(width)*channels[k].size;
+
+  //offset table, then the blocks of scanlines : y, data size and data
+  int n_blocks = (height + lines - 1)/lines;
+  if(pos + 8*size_t(n_blocks) > size)
+    return false;
+
+  TImage result(height, width, n_channels);
+  std::vector<unsigned char> block, buffer;
+  for(int b=0; b<n_blocks; ++b){
+    size_t offset = size_t(read_uint64(&bytes[pos + 8*b]));
+    if(offset + 8 > size)
+      return false;
+
+    int y0 = int(read_uint32(&bytes[offset])) - y_min;
+    size_t data_size = read_uint32(&bytes[offset+4]);
+    const unsigned char* data = &bytes[offset+8];
+    if(y0 < 0 || y0 >= height || offset + 8 + data_size > size)
+      return false;
+
+    int n_lines = std::min(lines, height - y0);
+    block.resize(n_lines*line_size);
+
+    //blocks that do not get smaller are stored uncompressed
+    if(data_size == block.size())
+      std::memcpy(&block[0], data, block.size());
+    else if(compression == EXR_NO_COMPRESSION || !exr_unzip(data, data_size, block, buffer))
+      return false;
+
+    //each line stores the channels one after the other
+    const unsigned char* p = &block[0];
+    for(int l=0; l<n_lines; ++l){
+      int j = y0 + l;
+      for(size_t k=0; k<channels.size(); ++k){
+        const ExrChannel& channel = channels[k];
+        if(channel.target < 0){
+          p += width*channel.size;
+          continue;
+        }
+
+        for(int i=0; i<width; ++i, p+=channel.size){
+          switch(channel.type){
+          case EXR_UINT : result.data(i, j, channel.target) = Scalar(read_uint32(p)); break;
+          case EXR_HALF : result.data(i, j, channel.target) = Scalar(read_half(p))  ; break;
+          case EXR_FLOAT: result.data(i, j, channel.target) = Scalar(read_float(p)) ; break;
+          }
+        }
+      }
+    }
+  }
+
+  image = std::move(result);
+  return true;
+}
+
+/* PNM ************************************************************************/
+
+bool write_pnm(const QuantizedImage& image, const std::string& filename)
+{
+  if(!image.is_valid() || (image.channel() != 1 && image.channel() != 3))
+    return false;
+
+  std::FILE* file = std::fopen(filename.c_str(), "wb");
+  if(!file)
+    return false;
+
+  std::fprintf(file, "P%c\n%d %d\n%d\n", image.channel() == 1 ? '5' : '6',
+               image.width(), image.height(), image.max_value());
+
+  size_t row_size = size_t(image.width())*image.channel();
+  bool success = true;
+
+  if(image.bytes_per_value() == 1)
+    success = std::fwrite(image.data8(), 1, row_size*image.height(), file) == row_size*image.height();
+  else{
+    std::vector<unsigned char> row(2*row_size);
+    for(int j=0; j<image.height() && success; ++j){
+      const uint16_t* values = image.data16() + j*row_size;
+      for(size_t k=0; k<row_size; ++k){
+        row[2*k]   = (unsigned char)(values[k] >> 8);
+        row[2*k+1] = (unsigned char)(values[k] & 0xff);
+      }
+      success = std::fwrite(&row[0], 1, row.size(), file) == row.size();
+    }
+  }
+
+  return std::fclose(file) == 0 && success;
+}
+
+/* explicit instantiations ****************************************************/
+template bool read_pfm(ImageT<double, PLANAR     >&, const std::string&);
+template bool read_pfm(ImageT<double, INTERLEAVED>&, const std::string&);
+template bool read_pfm(ImageT<float , PLANAR     >&, const std::string&);
+template bool read_pfm(ImageT<float , INTERLEAVED>&, const std::string&);
+
+template bool read_rgbe(ImageT<double, PLANAR     >&, const std::string&);
+template bool read_rgbe(ImageT<double, INTERLEAVED>&, const std::string&);
+template bool read_rgbe(ImageT<float , PLANAR     >&, const std::string&);
+template bool read_rgbe(ImageT<float , INTERLEAVED>&, const std::string&);
+
+template bool read_exr(ImageT<double, PLANAR     >&, const std::string&);
+template bool read_exr(ImageT<double, INTERLEAVED>&, const std::string&);
+template bool read_exr(ImageT<float , PLANAR     >&, const std::string&);
+template bool read_exr(ImageT<float , INTERLEAVED>&, const std::string&);
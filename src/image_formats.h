@@ -0,0 +1,53 @@
+#ifndef IMAGE_FORMATS_H
+#define IMAGE_FORMATS_H
+
+#include <string>
+
+#include "image.h"
+#include "quantized_image.h"
+
+/**
+ * @brief built-in readers of the common hdr file formats. They decode the
+ *        pixels directly into the storage of the image, whatever its scalar
+ *        type and layout, without going through CImg.
+ *
+ *        Supported files:
+ *          - PFM : 1 or 3 channels, both byte orders
+ *          - Radiance RGBE (.hdr, .pic) : flat or run-length encoded
+ *            scanlines, standard orientation (-Y h +X w)
+ *          - OpenEXR : single part scanline files, uncompressed or ZIP/ZIPS
+ *            compressed (ZIP requires zlib, see HDR_USE_ZLIB), half, float or
+ *            uint channels. R, G and B are read (or Y for luminance images),
+ *            the other channels are ignored
+ *
+ *        All readers return false when the file cannot be opened or uses a
+ *        feature that is not supported, in which case image is left unchanged.
+ */
+
+/**
+ * @brief reads a PFM (portable float map) file
+ */
+template<class TImage>
+bool read_pfm(TImage& image, const std::string& filename);
+
+/**
+ * @brief reads a Radiance RGBE file
+ */
+template<class TImage>
+bool read_rgbe(TImage& image, const std::string& filename);
+
+/**
+ * @brief reads an OpenEXR file
+ */
+template<class TImage>
+bool read_exr(TImage& image, const std::string& filename);
+
+/**
+ * @brief writes a quantized image with 1 (PGM) or 3 (PPM) channels as a
+ *        binary PNM file whose maximum value is 2^bits-1. 8 bit values are
+ *        written as they are stored, 16 bit values are converted to big
+ *        endian row by row.
+ */
+bool write_pnm(const QuantizedImage& image, const std::string& filename);
+
+#endif //IMAGE_FORMATS_H
@@ -1,13 +1,119 @@
 #include "image_io.h"
+#include "image_formats.h"
+
+#include <algorithm>
+#include <cctype>
 
 #include <CImg/CImg.h>
 
-bool read_image(Image& image,
+/* helper functions ***********************************************************/
+
+/**
+ * @brief lower case extension of filename
+ */
+static std::string extension(const std::string& filename)
+{
+  size_t dot = filename.find_last_of(".");
+  if(dot == std::string::npos)
+    return std::string();
+
+  std::string ext = filename.substr(dot+1);
+  std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+  return ext;
+}
+
+/**
+ * @brief rescales image to h x w using linear interpolation. The image data is
+ *        shared with a CImg whose axes follow the memory layout, so that CImg
+ *        resizes it without an intermediate copy.
+ */
+template<class TImage>
+static void resize_image(TImage& image, int h, int w)
+{
+  typedef typename TImage::Scalar Scalar;
+
+  if(h == image.height() && w == image.width())
+    return;
+
+  //views with a stride are packed first
+  TImage packed;
+  const TImage& source = image.is_contiguous() ? image : (packed = image);
+
+  int c = source.channel();
+  const Scalar* data = source.data().data();
+
+  //planar : y, x, channel ; interleaved : channel, y, x
+  cimg_library::CImg<Scalar> temp;
+  if(int(TImage::Layout) == PLANAR)
+    temp = cimg_library::CImg<Scalar>(data, source.height(), source.width(), 1, c, true).get_resize(h, w, 1, c, 3);
+  else
+    temp = cimg_library::CImg<Scalar>(data, c, source.height(), source.width(), 1, true).get_resize(c, h, w, 1, 3);
+
+  image.resize(h, w, c);
+  image.data() = Eigen::Map<typename TImage::DataType>(temp.data(), h*w, c);
+}
+
+/**
+ * @brief a channel of a CImg is stored x first, a channel of an image y first :
+ *        the copy is a transposition of the whole channel.
+ */
+typedef Eigen::Stride<Eigen::Dynamic, Eigen::Dynamic> PlaneStride;
+
+template<class TImage>
+static void copy_channel(const cimg_library::CImg<typename TImage::Scalar>& from, TImage& to, int c)
+{
+  typedef Eigen::Array<typename TImage::Scalar, Eigen::Dynamic, Eigen::Dynamic> Plane;
+
+  int h = to.height(), w = to.width();
+  Eigen::Map<Plane, Eigen::Unaligned, PlaneStride>
+      plane(to.data().data() + c*to.channel_stride(), h, w, PlaneStride(h*to.pixel_stride(), to.pixel_stride()));
+
+  plane = Eigen::Map<const Plane>(from.data(0, 0, 0, c), w, h).transpose();
+}
+
+template<class TImage>
+static void copy_channel(const TImage& from, cimg_library::CImg<typename TImage::Scalar>& to, int c)
+{
+  typedef Eigen::Array<typename TImage::Scalar, Eigen::Dynamic, Eigen::Dynamic> Plane;
+
+  int h = from.height(), w = from.width();
+  Eigen::Map<const Plane, Eigen::Unaligned, PlaneStride>
+      plane(from.data().data() + c*from.channel_stride(), h, w, PlaneStride(h*from.pixel_stride(), from.pixel_stride()));
+
+  Eigen::Map<Plane>(to.data(0, 0, 0, c), w, h) = plane.transpose();
+}
+
+template<class TImage>
+bool read_image(TImage& image,
                 const std::string& filename,
                 unsigned int h,
                 unsigned int w)
 {
-  cimg_library::CImg<double> temp(filename.c_str());
+  //hdr formats are decoded by the built-in readers
+  std::string ext = extension(filename);
+
+  bool decoded = false;
+  if(ext == "pfm")
+    decoded = read_pfm(image, filename);
+  else if(ext == "hdr" || ext == "pic")
+    decoded = read_rgbe(image, filename);
+  else if(ext == "exr")
+    decoded = read_exr(image, filename);
+
+  if(decoded){
+    resize_image(image, h == 0 ? image.height() : int(h), w == 0 ? image.width() : int(w));
+    return true;
+  }
+
+  //other formats, and files that the built-in readers do not support, are
+  //loaded with CImg
+  cimg_library::CImg<typename TImage::Scalar> temp;
+  try{
+    temp.load(filename.c_str());
+  }
+  catch(const cimg_library::CImgException&){
+    return false;
+  }
 
   if(temp.is_empty())
     return false;
@@ -27,22 +133,16 @@ bool read_image(Image& image,
   if(rescale)
     temp.resize(w, h, 1, temp.spectrum(), 3) ; // rescale using linear interpolation
 
-  image = Image(temp.height(), temp.width(), temp.spectrum());
-  for(int i=0; i<w; ++i){
-    for(int j=0; j<h; ++j){
-      int id = i*h + j;
+  image.resize(temp.height(), temp.width(), temp.spectrum());
 
-      for(int c=0; c<temp.spectrum(); ++c){
-        image.data(i, j, c) = temp(i, j, 0, c);
-      }
-
-    }
-  }
+  for(int c=0; c<temp.spectrum(); ++c)
+    copy_channel(temp, image, c);
 
   return true;
 }
 
-bool write_image(const Image &image,
+template<class TImage>
+bool write_image(const TImage &image,
                  const std::string& filename)
 {
   if(!image.is_valid())
@@ -51,16 +151,76 @@ bool write_image(const Image &image,
   int h = image.height();
   int w = image.width();
 
-  cimg_library::CImg<double> temp(w, h, 1, 3, 0);
-  for(int i=0; i<w; ++i){
-    for(int j=0; j<h; ++j){
+  cimg_library::CImg<typename TImage::Scalar> temp(w, h, 1, 3, 0);
+  for(int c=0; c<std::min(image.channel(), 3); ++c)
+    copy_channel(image, temp, c);
 
-      for(int c=0; c<image.channel(); ++c)
-        temp(i, j, 0., c) = image.data(i, j, c);
-    }
+  try{
+    temp.save(filename.c_str());
+  }
+  catch(const cimg_library::CImgException&){
+    return false;
   }
 
-  temp.save(filename.c_str());
+  return true;
+}
+
+/**
+ * @brief saves the values of image, of type TValue, with CImg. The values are
+ *        rescaled to the full range of TValue (8 or 16 bits), the formats
+ *        written by CImg having no other bit depth.
+ */
+template<class TValue>
+static bool save_quantized(const QuantizedImage& image, const TValue* values, const std::string& filename)
+{
+  int h = image.height(), w = image.width(), c = image.channel();
+
+  //value*range/max_value, rounded
+  uint32_t range = (1u << (8*sizeof(TValue))) - 1;
+  uint32_t max_value = uint32_t(image.max_value());
+
+  cimg_library::CImg<TValue> temp(w, h, 1, c);
+  for(int k=0; k<c; ++k)
+    for(int j=0; j<h; ++j)
+      for(int i=0; i<w; ++i){
+        uint32_t value = values[image.index(i, j, k)];
+        temp(i, j, 0, k) = max_value == range ? TValue(value) : TValue((value*range + max_value/2)/max_value);
+      }
+
+  try{
+    temp.save(filename.c_str());
+  }
+  catch(const cimg_library::CImgException&){
+    return false;
+  }
 
   return true;
 }
+
+bool write_image(const QuantizedImage& image,
+                 const std::string& filename)
+{
+  if(!image.is_valid())
+    return false;
+
+  std::string ext = extension(filename);
+  if(ext == "ppm" || ext == "pgm" || ext == "pnm")
+    return write_pnm(image, filename);
+
+  //CImg uses planar values
+  if(image.bytes_per_value() == 1)
+    return save_quantized(image, image.data8(), filename);
+  else
+    return save_quantized(image, image.data16(), filename);
+}
+
+/* explicit instantiations ****************************************************/
+template bool read_image(ImageT<double, PLANAR     >&, const std::string&, unsigned int, unsigned int);
+template bool read_image(ImageT<double, INTERLEAVED>&, const std::string&, unsigned int, unsigned int);
+template bool read_image(ImageT<float , PLANAR     >&, const std::string&, unsigned int, unsigned int);
+template bool read_image(ImageT<float , INTERLEAVED>&, const std::string&, unsigned int, unsigned int);
+
+template bool write_image(const ImageT<double, PLANAR     >&, const std::string&);
+template bool write_image(const ImageT<double, INTERLEAVED>&, const std::string&);
+template bool write_image(const ImageT<float , PLANAR     >&, const std::string&);
+template bool write_image(const ImageT<float , INTERLEAVED>&, const std::string&);
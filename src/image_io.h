@@ -4,17 +4,23 @@
 #include <string>
 
 #include "image.h"
+#include "quantized_image.h"
 
 /**
  * @brief simple function that reads an image and resizes it if necessary
- *        This functions uses CImg for reading and resizing.
+ *        PFM, Radiance RGBE (.hdr, .pic) and EXR files are decoded by the
+ *        built-in readers of image_formats.h, other files (and hdr files
+ *        using features they do not support) are read with CImg.
+ *        This functions uses CImg for resizing.
+ *        Implemented for the image types of image.h (any scalar and layout).
  * @param image is the output
  * @param filename is the path of the image
  * @param h is the new height of the image, set to 0 if no height resize is desired
  * @param w is the new width of the image, set to 0 if not width resize is desired
  * @return true if reading was successfull and false if not
  */
-bool read_image(Image& image,
+template<class TImage>
+bool read_image(TImage& image,
                 const std::string& filename,
                 unsigned int h=0,
                 unsigned int w=0);
@@ -26,7 +32,20 @@ bool read_image(Image& image,
  * @param filename is the path of the image
  * @return true if writing was successfull.
  */
-bool write_image(const Image &image,
+template<class TImage>
+bool write_image(const TImage &image,
+                 const std::string& filename);
+
+/**
+ * @brief saves a quantized image. PNM files (.ppm, .pgm, .pnm) are written
+ *        by the built-in writer (see write_pnm()), with the bit depth of the
+ *        image. Other formats are written with CImg, as 8 bit values (up to
+ *        8 bits) or 16 bit values (above), rescaled to their full range.
+ * @param image is the input
+ * @param filename is the path of the image
+ * @return true if writing was successfull.
+ */
+bool write_image(const QuantizedImage& image,
                  const std::string& filename);
 
 #endif //IMAGE_IO_H
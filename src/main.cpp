@@ -1,28 +1,47 @@
 #include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <thread>
 
 #include "input_parser.h"
 
 #include "image.h"
 #include "image_io.h"
+#include "quantized_image.h"
+#include "parallel.h"
 
-#include "psf.h"
-#include "display_response.h"
-#include "hdr_display.h"
+#include "display_models.h"
 
 std::vector<std::string> valild_formats{ "png",
                                          "jpg",
-                                         "jpeg" } ; //add more valid formats here
+                                         "jpeg",
+                                         "ppm" } ; //add more valid formats here
 
 void output_usage()
 {
   std::cout << "./hdr <option> <values>" << std::endl;
-  std::cout << "  -in  [filename]               : input image" << std::endl;
+  std::cout << "  -in  [filename]               : input image, or printf-style pattern with -frames" << std::endl;
+  std::cout << "  -frames [first] [last]        : frame numbers of a sequence pattern (optional)" << std::endl;
+  std::cout << "  -list [filename]              : text file listing the input images, one per line (optional)" << std::endl;
+  std::cout << "  -inflight [count]             : frames buffered between pipeline stages (optional)" << std::endl;
   std::cout << "  -out [format]                 : format of output image (optional)" << std::endl;
   std::cout << "  -res [width] [height]         : output resolution      (optional)" << std::endl;
+  std::cout << "  -dlpres [width] [height]      : resolution of the dlp image (optional)" << std::endl;
   std::cout << "  -psf [sigma]                  : gaussian psf parameter (optional)" << std::endl;
   std::cout << "  -dlp [Lpeak] [Lblack] [gamma] : dlp response model     (optional)" << std::endl;
   std::cout << "  -lcd [Lpeak] [Lblack] [gamma] : lcd response model     (optional)" << std::endl;
+  std::cout << "  -threads [count]              : number of threads      (optional)" << std::endl;
+  std::cout << "  -eval [exact|fast|lut] [bits] : response evaluation    (optional)" << std::endl;
+  std::cout << "  -fused [tile size]            : tiled execution        (optional)" << std::endl;
+  std::cout << "  -incremental [tile size]      : recomputes the tiles that changed (optional)" << std::endl;
+  std::cout << "  -blur [exact|pyramid|recursive|box3] [levels] : psf blur approximation (optional)" << std::endl;
+  std::cout << "  -solver [closed|iterative] [levels] [iterations] [refinements] : dlp/lcd split (optional)" << std::endl;
+  std::cout << "  -bits [1 to 16] [dither]      : bit depth of the outputs (optional)" << std::endl;
+  std::cout << "  -simulate                     : prints the accuracy of the displayed frames (optional)" << std::endl;
+  std::cout << "  -stats                        : prints the time of each step (optional)" << std::endl;
 }
 
 void check_format_validity(std::string& format)
@@ -33,63 +52,57 @@ void check_format_validity(std::string& format)
   }
 }
 
-/* PSF Model *************************************************/
-struct PSFParams
+/**
+ * @brief builds the output filename of an input image : the input name
+ *        without its directory and extension, followed by suffix and format
+ */
+std::string output_name(const std::string& filename, const std::string& suffix, const std::string& format)
 {
- int h;
- int w;
- int c;
- double sigma;
-
- PSFParams(double pixels=8.)
- : h(int(pixels)), w(int(pixels)), c(3), sigma(pixels)
- {}
-
- void set_sigma(double pixels)
- {
-   sigma = pixels;
-   h = int(pixels);
-   w = int(pixels);
- }
-};
-
-typedef GaussianPSF<Image, PSFParams> PSF;
-/*************************************************************/
-
-/* Display Response Model ************************************/
-struct DRParams
-{
- double Lpeak;
- double Lblack;
- double gamma;
-
- DRParams(int _Lpeak=1, int _Lbalck=0, double _gamma=2.2)
- : Lpeak(_Lpeak), Lblack(_Lbalck), gamma(_gamma)
- {}
-};
+  std::string image_name = filename.substr(filename.find_last_of("/")+1,
+                                           filename.find_last_of(".")-filename.find_last_of("/")-1);
 
-typedef GainOffsetGamma<Image, DRParams> DisplayResponse;
-/*************************************************************/
+  return image_name.append(suffix).append(".").append(format);
+}
 
-/* HDR Display Algorithm *************************************/
-struct HDRDisplayParams
+/**
+ * @brief builds the list of input images from the -in, -frames and -list
+ *        options
+ * @return false if no input image is given
+ */
+bool input_frames(const InputParser& parser, std::vector<std::string>& frames)
 {
- PSF* psf;
- DisplayResponse* dlp_response;
- DisplayResponse* lcd_response;
-
- HDRDisplayParams(PSF* _psf=NULL, DisplayResponse* _dlp=NULL, DisplayResponse* _lcd=NULL)
- : psf(_psf), dlp_response(_dlp), lcd_response(_lcd)
- {}
-};
+  InputParser::TokenList tokens;
+  frames.clear();
+
+  if(parser.getCmdOption("-list", tokens) > 0){
+    std::ifstream list(tokens[0].c_str());
+    std::string line;
+    while(std::getline(list, line))
+      if(!line.empty())
+        frames.push_back(line);
+  }
+  else if(parser.getCmdOption("-in", tokens) > 0){
+    std::string pattern = tokens[0];
+
+    if(parser.getCmdOption("-frames", tokens) == 2){
+      int first = std::atoi(tokens[0].c_str());
+      int last  = std::atoi(tokens[1].c_str());
+
+      std::vector<char> buffer(pattern.size() + 64);
+      for(int f=first; f<=last; ++f){
+        std::snprintf(&buffer[0], buffer.size(), pattern.c_str(), f);
+        frames.push_back(std::string(&buffer[0]));
+      }
+    }
+    else
+      frames.push_back(pattern);
+  }
 
-typedef ProjectorBasedDisplay<Image, HDRDisplayParams> HDRDisplay;
-/**************************************************************/
+  return !frames.empty();
+}
 
 int main(int argc, char** argv)
 {
-  bool success = true;
-
   InputParser parser(argc, argv);
 
   if(parser.cmdOptionExists("-h") || parser.cmdOptionExists("-help")){
@@ -99,13 +112,10 @@ int main(int argc, char** argv)
 
   InputParser::TokenList tokens;
 
-  //input image
-  std::string filename;
-
-  if(parser.getCmdOption("-in", tokens) > 0)
-    filename = tokens[0];
-  else{
-    std::cerr << "error parsing input image : -in option not found" << std::endl;
+  //input images
+  std::vector<std::string> frames;
+  if(!input_frames(parser, frames)){
+    std::cerr << "error parsing input image : -in or -list option not found" << std::endl;
     output_usage();
     return 1;
   }
@@ -121,6 +131,7 @@ int main(int argc, char** argv)
   PSFParams p_psf(8.);
   DRParams  p_dlp(5000., 5., 2.2);
   DRParams  p_lcd(1., 0.005, 2.2);
+  int inflight = 2;
 
   //load parameter values if available
   if(parser.getCmdOption("-res", tokens) == 2){
@@ -128,6 +139,13 @@ int main(int argc, char** argv)
     h = std::atof(tokens[1].c_str());
   }
 
+  //the dlp image has the resolution of the lcd one by default
+  int dlp_w = 0, dlp_h = 0;
+  if(parser.getCmdOption("-dlpres", tokens) == 2){
+    dlp_w = std::atoi(tokens[0].c_str());
+    dlp_h = std::atoi(tokens[1].c_str());
+  }
+
   if(parser.getCmdOption("-psf", tokens) > 0)
     p_psf.set_sigma(std::atof(tokens[0].c_str()));
 
@@ -142,59 +160,280 @@ int main(int argc, char** argv)
     p_lcd.Lblack = std::atof(tokens[1].c_str());
     p_lcd.gamma  = std::atof(tokens[2].c_str());
   }
-  
-    //load image
-  Image i_hdr;
-  success = read_image(i_hdr, filename, h, w);
-  if(!success){
-    std::cerr << "unable to load image" << std::endl;
-    return -1;
-  }
 
-  std::cout << "image loaded." << std::endl;
+  if(parser.getCmdOption("-threads", tokens) > 0)
+    set_thread_count(std::atoi(tokens[0].c_str()));
 
-  write_image(i_hdr, "test.png");
-  
- //make sure that the psf has the same number of channels as the input image
- p_psf.c = i_hdr.channel();
+  if(parser.getCmdOption("-inflight", tokens) > 0)
+    inflight = std::atoi(tokens[0].c_str());
 
- //create models
- PSF psf(p_psf);
- DisplayResponse r_dlp(p_dlp);
- DisplayResponse r_lcd(p_lcd);
+  //outputs are quantized by the processing stage, only the integer images are
+  //kept until they are saved
+  int bits = 8;
+  bool dither = false;
+  if(parser.getCmdOption("-bits", tokens) > 0){
+    int value = std::atoi(tokens[0].c_str());
+    if(value >= 1 && value <= 16)
+      bits = value;
+    else
+      std::cerr << tokens[0] << " is not a valid number of bits (1 to 16), using " << bits << " instead" << std::endl;
 
- HDRDisplayParams p_hdr(&psf, &r_dlp, &r_lcd);
- HDRDisplay hdr(p_hdr);
+    dither = tokens.size() > 1 && tokens[1] == "dither";
+  }
 
- //run algorithm
- Image i_dlp, i_lcd;
- std::cout << "processing hdr ... " << std::flush;
- hdr.process(i_hdr, i_dlp, i_lcd);
- std::cout << "done." << std::endl;
+  ResponseEvaluation evaluation = EVALUATION_EXACT;
+  int evaluation_bits = 8;
+  if(parser.getCmdOption("-eval", tokens) > 0){
+    if(tokens[0] == "fast")
+      evaluation = EVALUATION_FAST;
+    else if(tokens[0] == "lut")
+      evaluation = EVALUATION_LUT;
+    else if(tokens[0] != "exact")
+      std::cerr << tokens[0] << " is not a valid evaluation mode, using exact instead" << std::endl;
+
+    //the lookup tables have the bit depth of the outputs by default, with
+    //fewer bits the outputs only take some of their levels
+    evaluation_bits = bits;
+    if(tokens.size() > 1){
+      int value = std::atoi(tokens[1].c_str());
+      if(value >= 1 && value <= 16)
+        evaluation_bits = value;
+      else
+        std::cerr << tokens[1] << " is not a valid number of bits (1 to 16), using " << evaluation_bits << " instead" << std::endl;
+    }
+
+    if(evaluation == EVALUATION_LUT && evaluation_bits < bits)
+      std::cerr << "the lookup tables have " << evaluation_bits << " bits, the " << bits << " bit outputs only take " << (1 << evaluation_bits) << " of their levels" << std::endl;
+  }
 
- //i_dlp and i_lcd are between 0 and 1
- //perfrom a linear map between 0 and 255 and save
- i_dlp.data() *= 255.;
- i_lcd.data() *= 255.;
+  BlurMode blur = BLUR_EXACT;
+  int blur_levels = 2;
+  if(parser.getCmdOption("-blur", tokens) > 0){
+    if(tokens[0] == "pyramid")
+      blur = BLUR_PYRAMID;
+    else if(tokens[0] == "recursive")
+      blur = BLUR_RECURSIVE;
+    else if(tokens[0].compare(0, 3, "box") == 0){
+      //box[passes], 3 passes by default
+      blur = BLUR_BOX;
+      blur_levels = tokens[0].size() > 3 ? std::atoi(tokens[0].c_str() + 3) : 3;
+    }
+    else if(tokens[0] != "exact")
+      std::cerr << tokens[0] << " is not a valid blur mode, using exact instead" << std::endl;
+
+    if(tokens.size() > 1)
+      blur_levels = std::atoi(tokens[1].c_str());
+  }
 
- //compute output filenames
- std::string image_name = filename.substr(filename.find_last_of("/")+1,
-                                          filename.find_last_of(".")-filename.find_last_of("/")-1);
+  bool iterative = false;
+  int solver_levels = 3, solver_iterations = 10, solver_refinements = 0;
+  if(parser.getCmdOption("-solver", tokens) > 0){
+    if(tokens[0] == "iterative")
+      iterative = true;
+    else if(tokens[0] != "closed")
+      std::cerr << tokens[0] << " is not a valid solver, using closed instead" << std::endl;
+
+    if(tokens.size() > 1)
+      solver_levels = std::atoi(tokens[1].c_str());
+    if(tokens.size() > 2)
+      solver_iterations = std::atoi(tokens[2].c_str());
+    if(tokens.size() > 3)
+      solver_refinements = std::atoi(tokens[3].c_str());
+  }
 
- std::string dlp_out(image_name), lcd_out(image_name);
- dlp_out.append("_dlp.").append(format);
- lcd_out.append("_lcd.").append(format);
+  //the three stages of the pipeline (read, process, write) run on their own
+  //thread and exchange frames through bounded queues
+  struct Frame
+  {
+    std::string filename;
+    Image hdr;
+    QuantizedImage dlp, lcd;
+    std::shared_ptr<PSF> simulation_psf;
+  };
+  typedef std::unique_ptr<Frame> FramePtr;
+
+  BoundedQueue<FramePtr> loaded(inflight), processed(inflight);
+  std::atomic<bool> read_failure(false), write_failure(false);
+
+  //load images
+  std::thread reader([&]()
+  {
+    for(size_t f=0; f<frames.size(); ++f){
+      FramePtr frame(new Frame);
+      frame->filename = frames[f];
+
+      if(!read_image(frame->hdr, frame->filename, h, w)){
+        std::cerr << "unable to load image " << frame->filename << std::endl;
+        read_failure = true;
+        continue;
+      }
+
+      std::cout << frame->filename << " loaded." << std::endl;
+      loaded.push(std::move(frame));
+    }
+    loaded.close();
+  });
+
+  //the display responses are shared by the processing and the writer threads
+  DisplayResponse r_dlp(p_dlp);
+  DisplayResponse r_lcd(p_lcd);
+  r_dlp.set_evaluation(evaluation, evaluation_bits);
+  r_lcd.set_evaluation(evaluation, evaluation_bits);
+
+  //the simulation of the displayed frames runs on the writer thread, with its
+  //own psf as the caches of the psf are not thread safe. The psf is passed
+  //with the frames, as it is created again when the number of channels changes.
+  //The parallel loops of the simulation and of the processing share the thread
+  //pool and run one at a time (see parallel_for()) : only the serial parts of
+  //the simulation overlap with the processing, most of its cost adds to the
+  //time of each frame
+  bool simulate = parser.cmdOptionExists("-simulate");
+  std::shared_ptr<PSF> simulation_psf;
+  Simulator simulator;
+
+  //save images
+  std::thread writer([&]()
+  {
+    FramePtr frame;
+    Image dlp, lcd;
+    std::shared_ptr<PSF> simulated_psf;
+    while(processed.pop(frame)){
+      //the frame is simulated with the quantized values sent to the displays
+      if(simulate){
+        if(frame->simulation_psf != simulated_psf){
+          simulated_psf = frame->simulation_psf;
+          simulator.set_model_parameters(HDRDisplayParams(simulated_psf.get(), &r_dlp, &r_lcd));
+        }
+
+        dequantize(frame->dlp, dlp);
+        dequantize(frame->lcd, lcd);
+
+        SimulationStats stats = simulator.simulate(frame->hdr, dlp, lcd);
+        std::cout << frame->filename << " simulation : ";
+        stats.print(std::cout);
+        std::cout << std::endl;
+      }
+
+      std::string dlp_name = output_name(frame->filename, "_dlp", format);
+      if(!write_image(frame->dlp, dlp_name)){
+        std::cerr << "unable to save " << dlp_name << std::endl;
+        write_failure = true;
+      }
+      else
+        std::cout << dlp_name << " saved." << std::endl;
+
+      std::string lcd_name = output_name(frame->filename, "_lcd", format);
+      if(!write_image(frame->lcd, lcd_name)){
+        std::cerr << "unable to save " << lcd_name << std::endl;
+        write_failure = true;
+      }
+      else
+        std::cout << lcd_name << " saved." << std::endl;
+    }
+  });
+
+  //the psf is created with the first frame, as it needs the number of
+  //channels of the images, and is created again when a frame of the sequence
+  //has another number of channels
+  std::unique_ptr<PSF> psf;
+  double psf_sigma = p_psf.sigma;
+
+  ClosedFormDisplay closed_form;
+  if(parser.cmdOptionExists("-fused")){
+    int tile_size = 64;
+    if(parser.getCmdOption("-fused", tokens) > 0){
+      int size = std::atoi(tokens[0].c_str());
+      if(size >= 1)
+        tile_size = size;
+      else
+        std::cerr << tokens[0] << " is not a valid tile size, using " << tile_size << " instead" << std::endl;
+    }
+    closed_form.set_fused(true, tile_size);
+  }
+  if(parser.cmdOptionExists("-incremental")){
+    int tile_size = 64;
+    if(parser.getCmdOption("-incremental", tokens) > 0){
+      int size = std::atoi(tokens[0].c_str());
+      if(size >= 1)
+        tile_size = size;
+      else
+        std::cerr << tokens[0] << " is not a valid tile size, using " << tile_size << " instead" << std::endl;
+    }
+    closed_form.set_incremental(true, tile_size);
+  }
 
- //save images
- success = write_image(i_dlp, dlp_out);
- if(!success)
-   std::cerr << "unable to save dlp image" << std::endl;
- std::cout << "dlp image saved." << std::endl;
+  if(dlp_w > 0 && dlp_h > 0)
+    closed_form.set_backlight_resolution(dlp_h, dlp_w);
+
+  IterativeDisplay iterative_display;
+  iterative_display.set_solver(solver_levels, solver_iterations, solver_refinements);
+  if(iterative && dlp_w > 0 && dlp_h > 0)
+    std::cerr << "the iterative solver does not support -dlpres, the dlp image has the resolution of the lcd" << std::endl;
+
+  HDRDisplay& hdr = iterative ? static_cast<HDRDisplay&>(iterative_display) : static_cast<HDRDisplay&>(closed_form);
+  hdr.set_stats(parser.cmdOptionExists("-stats"));
+
+  //run algorithm
+  FramePtr frame;
+  while(loaded.pop(frame)){
+    if(!psf || p_psf.c != frame->hdr.channel()){
+      //make sure that the psf has the same number of channels as the input image
+      p_psf.c = frame->hdr.channel();
+
+      //with its own resolution, the dlp image is blurred in its pixels : the
+      //psf is scaled by the horizontal ratio of the resolutions
+      bool dual = !iterative && dlp_w > 0 && dlp_h > 0;
+      if(dual)
+        p_psf.set_sigma(psf_sigma*dlp_w/frame->hdr.width());
+
+      psf.reset(new PSF(p_psf));
+      psf->set_blur(blur, blur_levels);
+      hdr.set_model_parameters(HDRDisplayParams(psf.get(), &r_dlp, &r_lcd));
+
+      if(simulate){
+        simulation_psf.reset(new PSF(p_psf));
+        simulation_psf->set_blur(blur, blur_levels);
+      }
+
+      //report the accuracy of the approximated blur on sqrt(I), the image
+      //blurred by the algorithm. The recursive blur needs a kernel close to an
+      //untruncated gaussian, and the -psf kernels are sigma pixels wide
+      if(blur != BLUR_EXACT && !psf->is_approximated())
+        std::cerr << "the psf cannot be approximated by this blur mode, using exact instead" << std::endl;
+      else if(blur != BLUR_EXACT){
+        Image sqroot;
+        if(dual)
+          frame->hdr.resample(dlp_h, dlp_w, sqroot);
+        else
+          sqroot = frame->hdr;
+        sqroot.data() = sqroot.data().sqrt();
+
+        double max_error, mean_error;
+        psf->blur_error(sqroot, max_error, mean_error);
+        std::cout << "blur deviation from exact : max " << max_error << ", mean " << mean_error << std::endl;
+      }
+    }
+
+    hdr.process(frame->hdr, bits, dither, frame->dlp, frame->lcd);
+    std::cout << frame->filename << " processed." << std::endl;
+
+    if(parser.cmdOptionExists("-stats")){
+      std::cout << frame->filename << " stats : ";
+      hdr.stats().print(std::cout);
+      std::cout << std::endl;
+    }
+
+    frame->simulation_psf = simulation_psf;
+    processed.push(std::move(frame));
+  }
+  processed.close();
 
- success = write_image(i_lcd, lcd_out);
- if(!success)
-   std::cerr << "unable to save lcd image" << std::endl;
- std::cout << "lcd image saved." << std::endl;
+  reader.join();
+  writer.join();
+
+  //frames that could not be loaded or saved were skipped
+  if(read_failure || write_failure)
+    return -1;
 
   return 0;
 }
@@ -0,0 +1,237 @@
+#include "parallel.h"
+
+#include <chrono>
+
+//set by set_thread_count(), read by the threads starting loops
+static std::atomic<int> s_thread_count(0);
+
+//time spent running tasks, in nanoseconds
+static std::atomic<long long> s_busy_time(0);
+
+void
+set_thread_count(int count)
+{
+  s_thread_count = std::max(count, 0);
+}
+
+int
+thread_count()
+{
+  int count = s_thread_count;
+  if(count > 0)
+    return count;
+
+  return std::max(int(std::thread::hardware_concurrency()), 1);
+}
+
+double
+parallel_busy_time()
+{
+  return double(s_busy_time)*1e-9;
+}
+
+/* per-thread accounting ******************************************************/
+
+/**
+ * @brief account of another thread charged with the work of the current one,
+ *        set on the threads of the pool while they run a loop
+ */
+static ThreadAccount*& charged_account()
+{
+  static thread_local ThreadAccount* s_charged = NULL;
+  return s_charged;
+}
+
+ThreadAccount&
+current_account()
+{
+  static thread_local ThreadAccount s_account;
+
+  ThreadAccount* charged = charged_account();
+  return charged ? *charged : s_account;
+}
+
+double
+thread_busy_time()
+{
+  return double(current_account().busy_ns)*1e-9;
+}
+
+/**
+ * @brief measures the time spent by a thread running tasks, charged to
+ *        account
+ */
+class BusyTimer
+{
+public:
+  BusyTimer(ThreadAccount& account)
+  : m_account(account), m_start(std::chrono::steady_clock::now())
+  {}
+
+  ~BusyTimer()
+  {
+    long long elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_start).count();
+    s_busy_time += elapsed;
+    m_account.busy_ns += elapsed;
+  }
+
+private:
+  ThreadAccount& m_account;
+  std::chrono::steady_clock::time_point m_start;
+};
+
+/* thread pool ****************************************************************/
+
+/**
+ * @brief threads waiting for the tasks of parallel_run(). A single loop runs at
+ *        a time, the calling thread working along with thread_count()-1
+ *        threads of the pool.
+ */
+class ThreadPool
+{
+public:
+  ThreadPool()
+  : m_stop(false), m_generation(0), m_count(0), m_call(NULL), m_task(NULL), m_account(NULL), m_running(0)
+  {}
+
+  ~ThreadPool()
+  {
+    resize(0);
+  }
+
+  void run(int count, TaskFunction call, const void* task)
+  {
+    std::lock_guard<std::mutex> run_lock(m_run_mutex);
+
+    int n_workers = thread_count() - 1;
+    if(int(m_threads.size()) != n_workers)
+      resize(n_workers);
+
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_count = count;
+      m_call  = call;
+      m_task  = task;
+      m_account = &current_account();
+      m_next  = 0;
+      m_running = int(m_threads.size());
+      ++m_generation;
+    }
+    m_start.notify_all();
+
+    execute();
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done.wait(lock, [this]{ return m_running == 0; });
+  }
+
+  /**
+   * @brief true on the threads of the pool, and on the calling thread while
+   *        it executes tasks
+   */
+  static bool& in_task()
+  {
+    static thread_local bool s_in_task = false;
+    return s_in_task;
+  }
+
+private:
+  void resize(int n_workers)
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_start.notify_all();
+
+    for(size_t t=0; t<m_threads.size(); ++t)
+      m_threads[t].join();
+    m_threads.clear();
+
+    m_stop = false;
+    for(int t=0; t<n_workers; ++t)
+      m_threads.push_back(std::thread(&ThreadPool::work, this, m_generation));
+  }
+
+  void work(unsigned int generation)
+  {
+    in_task() = true;
+
+    while(true){
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_start.wait(lock, [&]{ return m_stop || m_generation != generation; });
+        if(m_stop)
+          return;
+        generation = m_generation;
+      }
+
+      execute();
+
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if(--m_running == 0)
+        m_done.notify_one();
+    }
+  }
+
+  void execute()
+  {
+    BusyTimer timer(*m_account);
+
+    bool in_task_before = in_task();
+    in_task() = true;
+
+    //the work of the tasks is charged to the thread that started the loop
+    ThreadAccount* charged_before = charged_account();
+    charged_account() = m_account;
+
+    for(int i=m_next++; i<m_count; i=m_next++)
+      m_call(m_task, i);
+
+    charged_account() = charged_before;
+    in_task() = in_task_before;
+  }
+
+private:
+  std::vector<std::thread> m_threads;
+  bool m_stop;
+
+  //current loop
+  unsigned int m_generation;
+  int m_count;
+  TaskFunction m_call;
+  const void* m_task;
+  ThreadAccount* m_account;
+  std::atomic<int> m_next;
+  int m_running;
+
+  std::mutex m_run_mutex;
+  std::mutex m_mutex;
+  std::condition_variable m_start;
+  std::condition_variable m_done;
+};
+
+void
+parallel_run(int count, TaskFunction call, const void* task)
+{
+  static ThreadPool pool;
+
+  //nested loops run on the calling thread
+  if(ThreadPool::in_task()){
+    for(int i=0; i<count; ++i)
+      call(task, i);
+    return;
+  }
+
+  //so do loops that would run on a single thread
+  if(std::min(thread_count(), count) <= 1){
+    BusyTimer timer(current_account());
+    ThreadPool::in_task() = true;
+    for(int i=0; i<count; ++i)
+      call(task, i);
+    ThreadPool::in_task() = false;
+    return;
+  }
+
+  pool.run(count, call, task);
+}
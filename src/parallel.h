@@ -0,0 +1,170 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* thread count ***************************************************************/
+
+/**
+ * @brief sets the number of threads used by parallel_for.
+ * @param count is the number of threads, 0 uses the number of hardware threads
+ */
+void set_thread_count(int count);
+
+/**
+ * @brief returns the number of threads used by parallel_for (at least 1)
+ */
+int thread_count();
+
+/* parallel loop **************************************************************/
+
+/**
+ * @brief type erased task of parallel_for, calls task(i)
+ */
+typedef void (*TaskFunction)(const void* task, int i);
+
+template<class Function>
+void call_task(const void* task, int i)
+{
+  (*static_cast<const Function*>(task))(i);
+}
+
+/**
+ * @brief runs call(task, i) for every i in [0, count) on the thread pool, see
+ *        parallel_for()
+ */
+void parallel_run(int count, TaskFunction call, const void* task);
+
+/**
+ * @brief total time spent by all the threads running the tasks of
+ *        parallel_for, in seconds, since the start of the program. Divided by
+ *        thread_count() and by the elapsed time, it gives the utilization of
+ *        the threads over a period.
+ */
+double parallel_busy_time();
+
+/* per-thread accounting ******************************************************/
+
+/**
+ * @brief counters of the work done on behalf of a thread : by the thread
+ *        itself, and by the threads of the pool while they run the tasks of
+ *        its parallel_for loops.
+ */
+struct ThreadAccount
+{
+  //time spent running tasks, in nanoseconds
+  std::atomic<long long> busy_ns;
+
+  //bytes allocated for images (see count_image_allocation())
+  std::atomic<unsigned long long> allocated_bytes;
+
+  ThreadAccount()
+  : busy_ns(0), allocated_bytes(0)
+  {}
+};
+
+/**
+ * @brief account charged with the work of the current thread : its own, or
+ *        the one of the thread that started the loop whose tasks it runs
+ */
+ThreadAccount& current_account();
+
+/**
+ * @brief same as parallel_busy_time(), restricted to the loops started by the
+ *        calling thread. The loops of other threads (e.g. the reader and the
+ *        writer of a pipeline) are not included.
+ */
+double thread_busy_time();
+
+/**
+ * @brief calls task(i) for every i in [0, count). Tasks are handed out one at
+ *        a time to thread_count() threads, the calling thread being one of
+ *        them. Each task must only write to its own part of the output, so
+ *        that the result does not depend on the number of threads.
+ *
+ *        The other threads belong to a pool that is kept between calls, so
+ *        thread_local variables can be used as per-thread scratch buffers.
+ *        A parallel_for called from a task runs on the calling thread only,
+ *        and loops called by several threads at once run one after the other.
+ */
+template<class Function>
+void parallel_for(int count, const Function& task)
+{
+  parallel_run(count, &call_task<Function>, &task);
+}
+
+/* bounded queue **************************************************************/
+
+/**
+ * @brief a fifo queue with a maximum size, used to connect the stages of a
+ *        pipeline running on different threads. push() blocks while the queue
+ *        is full and pop() blocks while it is empty, so that the number of
+ *        items in flight stays bounded.
+ */
+template<class T>
+class BoundedQueue
+{
+public:
+  BoundedQueue(int capacity)
+  : m_capacity(std::max(capacity, 1)), m_closed(false)
+  {}
+
+  virtual ~BoundedQueue() {}
+
+  /**
+   * @brief adds value at the end of the queue, waits for a free slot
+   */
+  void push(T value)
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_not_full.wait(lock, [this]{ return int(m_queue.size()) < m_capacity; });
+
+    m_queue.push_back(std::move(value));
+    m_not_empty.notify_one();
+  }
+
+  /**
+   * @brief removes the first value of the queue, waits for one to be pushed
+   * @return false if the queue is empty and closed
+   */
+  bool pop(T& value)
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_not_empty.wait(lock, [this]{ return !m_queue.empty() || m_closed; });
+
+    if(m_queue.empty())
+      return false;
+
+    value = std::move(m_queue.front());
+    m_queue.pop_front();
+    m_not_full.notify_one();
+    return true;
+  }
+
+  /**
+   * @brief signals that no more values will be pushed
+   */
+  void close()
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_closed = true;
+    m_not_empty.notify_all();
+  }
+
+private:
+  std::deque<T> m_queue;
+  int m_capacity;
+  bool m_closed;
+
+  std::mutex m_mutex;
+  std::condition_variable m_not_full;
+  std::condition_variable m_not_empty;
+};
+
+#endif //PARALLEL_H
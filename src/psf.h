@@ -1,6 +1,47 @@
 #ifndef PSF_H
 #define PSF_H
 
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+#include "fft_convolution.h"
+
+/* blur modes ***************************************************************/
+
+/**
+ * @brief how BasePSF::convolve() applies the psf:
+ *          - BLUR_EXACT : convolution with the kernel
+ *          - BLUR_PYRAMID : convolution of the image reduced by 2^levels with
+ *            the kernel reduced by the same factor, followed by a bilinear
+ *            upsampling. The cost is divided by about 4^levels (2^levels for
+ *            separable psfs), the error is largest for kernels that are not
+ *            much wider than 2^levels pixels
+ *          - BLUR_RECURSIVE : recursive gaussian filter (see
+ *            ImageT::convolve_recursive()), whose cost does not depend on the
+ *            size of the psf. The gaussian matches the mean and variance of
+ *            the separable factors of the kernel (see moments()), and is only
+ *            used when the factors are within 1.5% of this untruncated
+ *            gaussian (see recursive_gaussian()), i.e. for kernels at least
+ *            about 6 sigmas wide. The deviation from the exact blur, relative
+ *            to its maximum, is then below 0.03 on an isolated point and
+ *            0.005 on natural frames, for sigmas from 4 to 200. The other
+ *            psfs, including the -psf kernels of the command line (sigma
+ *            pixels wide, nearly a box), use the exact blur
+ *          - BLUR_BOX : cascade of box filters (see ImageT::convolve_box()),
+ *            whose cost does not depend on the size of the psf either. The
+ *            boxes match the mean and variance of the separable factors of the
+ *            kernel, as the recursive gaussian.
+ *            Only for gaussian psfs, the other psfs use the exact blur
+ */
+enum BlurMode
+{
+  BLUR_EXACT,
+  BLUR_PYRAMID,
+  BLUR_RECURSIVE,
+  BLUR_BOX
+};
+
 /* base psf class **********************************************************/
 
 /**
@@ -12,6 +53,15 @@
  *        in order to define a new PSF model, it is required to extend this
  *        class, implement the generate() function and define its conrresponding
  *        parameter class
+ *
+ *        the kernels are cached : kernel(), kernel_x() and kernel_y() only call
+ *        generate() or generate_separable() after the parameters changed, and
+ *        convolve() and convolve_reduced() keep the spectra of the full and
+ *        reduced kernels for the fft convolution.
+ *        version() is incremented on every change of the parameters.
+ *        The caches, and the scratch images of the fft and pyramid modes
+ *        written by every call to convolve(), are updated by const functions,
+ *        so an instance must not be used by several threads at once.
  */
 template <class TImage, class TParam>
 class BasePSF
@@ -21,23 +71,400 @@ public:
   typedef TParam ParameterType;
 
 public:
-  BasePSF() {}
+  BasePSF()
+  : m_version(1), m_blur(BLUR_EXACT), m_levels(2), m_kernel_version(0), m_factors_version(0), m_reduced_version(0), m_reduced_levels(0)
+  {}
+
   BasePSF(const ParameterType& params)
-  : m_params(params)
+  : m_params(params), m_version(1), m_blur(BLUR_EXACT), m_levels(2), m_kernel_version(0), m_factors_version(0), m_reduced_version(0), m_reduced_levels(0)
   {}
 
   virtual ~BasePSF() {}
 
+  /**
+   * @brief sets the parameters, they are compared with the current ones
+   *        (ParameterType must provide operator==) and the cached kernels are
+   *        discarded only if they differ
+   */
   void set_model_parameters(const ParameterType& params)
   {
+    if(params == m_params)
+      return;
+
     m_params = params;
+    ++m_version;
+  }
+
+  inline unsigned int version() const
+  {
+    return m_version;
+  }
+
+  /**
+   * @brief selects how convolve() applies the psf
+   * @param levels is the number of pyramid levels (BLUR_PYRAMID) or of box
+   *        filters in each direction (BLUR_BOX, 3 to 8)
+   */
+  void set_blur(BlurMode blur, int levels=2)
+  {
+    m_blur = blur;
+    m_levels = std::max(levels, 0);
+    m_reduced_version = 0;
+  }
+
+  inline BlurMode blur() const
+  {
+    return m_blur;
+  }
+
+public:
+  /* cached kernels ***********************************************************/
+  /**
+   * @brief the kernel given by generate()
+   */
+  const ImageType& kernel() const
+  {
+    if(m_kernel_version != m_version){
+      generate(m_kernel);
+      m_kernel_version = m_version;
+    }
+    return m_kernel;
+  }
+
+  /**
+   * @brief the factors given by generate_separable()
+   */
+  const ImageType& kernel_x() const
+  {
+    update_factors();
+    return m_kernel_x;
+  }
+
+  const ImageType& kernel_y() const
+  {
+    update_factors();
+    return m_kernel_y;
+  }
+
+  /**
+   * @brief convolves in with the psf, according to the blur mode (see
+   *        set_blur()). The exact convolution uses two 1d passes for separable
+   *        psfs, otherwise the fft or direct convolution, whichever is faster
+   *        (see Image::convolve()).
+   */
+  void convolve(const ImageType& in, ImageType& out) const
+  {
+    switch(m_blur){
+    case BLUR_EXACT:
+      convolve_exact(in, kernel(), kernel_x(), kernel_y(), m_fft, out);
+      break;
+
+    case BLUR_PYRAMID:
+    {
+      int factor = 1 << m_levels;
+
+      in.downsample(factor, m_reduced_in);
+      convolve_reduced(m_reduced_in, m_levels, m_reduced_out);
+      m_reduced_out.upsample(factor, in.height(), in.width(), out);
+      break;
+    }
+
+    case BLUR_RECURSIVE:
+    {
+      double sigma_x, sigma_y, mean_x, mean_y;
+      if(recursive_gaussian(mean_x, mean_y, sigma_x, sigma_y))
+        in.convolve_recursive(sigma_x, sigma_y, out, mean_x, mean_y);
+      else
+        convolve_exact(in, kernel(), kernel_x(), kernel_y(), m_fft, out);
+      break;
+    }
+
+    case BLUR_BOX:
+    {
+      double sigma_x, sigma_y;
+      if(gaussian_sigma(sigma_x, sigma_y)){
+        double mean_x, mean_y;
+        moments(kernel_x(), mean_x, sigma_x);
+        moments(kernel_y(), mean_y, sigma_y);
+        in.convolve_box(sigma_x, sigma_y, std::max(m_levels, 3), out, mean_x, mean_y);
+      }
+      else
+        convolve_exact(in, kernel(), kernel_x(), kernel_y(), m_fft, out);
+      break;
+    }
+    }
+  }
+
+  /**
+   * @brief returns true if convolve() approximates the blur according to the
+   *        blur mode, false if it uses the exact convolution : the recursive
+   *        and box modes only approximate gaussian psfs, and the recursive
+   *        mode only the kernels close to an untruncated gaussian (see
+   *        recursive_gaussian())
+   */
+  bool is_approximated() const
+  {
+    double sigma_x, sigma_y, mean_x, mean_y;
+    switch(m_blur){
+    case BLUR_PYRAMID:
+      return true;
+    case BLUR_RECURSIVE:
+      return recursive_gaussian(mean_x, mean_y, sigma_x, sigma_y);
+    case BLUR_BOX:
+      return gaussian_sigma(sigma_x, sigma_y);
+    default:
+      return false;
+    }
+  }
+
+  /**
+   * @brief convolves an image reduced by 2^levels (see ImageT::downsample())
+   *        with the psf reduced by the same factor (see reduce()), whatever
+   *        the blur mode
+   */
+  void convolve_reduced(const ImageType& in, int levels, ImageType& out) const
+  {
+    update_reduced(levels);
+    convolve_exact(in, m_reduced_kernel, m_reduced_kernel_x, m_reduced_kernel_y, m_reduced_fft, out);
+  }
+
+  /**
+   * @brief compares convolve() with the exact convolution of in
+   * @param max_error is the maximum absolute difference, relative to the
+   *        maximum of the exact convolution
+   * @param mean_error is the mean absolute difference, relative to the
+   *        maximum of the exact convolution
+   */
+  void blur_error(const ImageType& in, double& max_error, double& mean_error) const
+  {
+    ImageType exact, approximation;
+    convolve_exact(in, kernel(), kernel_x(), kernel_y(), m_fft, exact);
+    convolve(in, approximation);
+
+    double scale = double(exact.data().abs().maxCoeff());
+    if(scale == 0.)
+      scale = 1.;
+
+    max_error  = double((approximation.data() - exact.data()).abs().maxCoeff()) / scale;
+    mean_error = double((approximation.data() - exact.data()).abs().mean()) / scale;
   }
 
 public:
+  /* kernel generation ********************************************************/
   virtual void generate(ImageType& psf) const = 0;
 
+  /**
+   * @brief returns true if the psf is a gaussian, in which case sigma_x and
+   *        sigma_y receive its standard deviations in pixels
+   */
+  virtual bool gaussian_sigma(double& /*sigma_x*/, double& /*sigma_y*/) const
+  {
+    return false;
+  }
+
+  /**
+   * @brief returns true if the psf can be written as the product of an
+   *        horizontal and a vertical 1d kernel. In this case
+   *        generate_separable() must be implemented.
+   */
+  virtual bool is_separable() const
+  {
+    return false;
+  }
+
+  /**
+   * @brief generates the 1d factors of a separable psf, such that
+   *        psf(x,y) = psf_x(x) * psf_y(y)
+   * @param psf_x is the horizontal kernel (an image of height 1)
+   * @param psf_y is the vertical kernel (an image of width 1)
+   */
+  virtual void generate_separable(ImageType& psf_x, ImageType& psf_y) const
+  {
+    psf_x = ImageType();
+    psf_y = ImageType();
+  }
+
+protected:
+  void update_factors() const
+  {
+    if(m_factors_version != m_version){
+      generate_separable(m_kernel_x, m_kernel_y);
+      m_factors_version = m_version;
+    }
+  }
+
+  /**
+   * @brief exact convolution with kernel, or its factors kernel_x and
+   *        kernel_y if the psf is separable
+   * @param fft is the engine keeping the spectrum of kernel : the full and
+   *        reduced kernels have their own, so that alternating between them
+   *        does not transform them again
+   */
+  void convolve_exact(const ImageType& in, const ImageType& kernel, const ImageType& kernel_x,
+                      const ImageType& kernel_y, FFTConvolution& fft, ImageType& out) const
+  {
+    if(is_separable())
+      in.convolve_separable(kernel_x, kernel_y, out);
+    else if(FFTConvolution::is_faster(in.height(), in.width(), kernel.height(), kernel.width()))
+      fft.convolve(in, kernel, out);
+    else
+      in.convolve_direct(kernel, out);
+  }
+
+  /**
+   * @brief mean offset from the center of the convolution (size/2) and
+   *        standard deviation of the first channel of a 1d kernel
+   */
+  static void moments(const ImageType& kernel, double& mean, double& sigma)
+  {
+    int size = int(kernel.data().rows());
+    double sum = 0., first = 0., second = 0.;
+    for(int k=0; k<size; ++k){
+      double weight = double(kernel.data()(k, 0)), d = double(k - size/2);
+      sum += weight;
+      first += weight*d;
+      second += weight*d*d;
+    }
+
+    mean = first/sum;
+    sigma = std::sqrt(std::max(second/sum - mean*mean, 0.));
+  }
+
+  /**
+   * @brief maximum difference between the first channel of a 1d kernel and
+   *        the untruncated gaussian of the given moments, relative to the
+   *        maximum of the kernel
+   */
+  static double gaussian_deviation(const ImageType& kernel, double mean, double sigma)
+  {
+    int size = int(kernel.data().rows());
+    double deviation = 0., peak = 0.;
+    for(int k=0; k<size; ++k){
+      double weight = double(kernel.data()(k, 0)), d = double(k - size/2) - mean;
+      double gaussian = sigma > 0. ? std::exp(-d*d/(2.*sigma*sigma))/(sigma*std::sqrt(2.*M_PI)) : (d == 0. ? 1. : 0.);
+      deviation = std::max(deviation, std::abs(weight - gaussian));
+      peak = std::max(peak, std::abs(weight));
+    }
+
+    return peak > 0. ? deviation/peak : 0.;
+  }
+
+  /**
+   * @brief moments of the gaussian of the recursive blur, returns false if
+   *        the psf is not a gaussian or if its factors deviate from the
+   *        untruncated gaussian by more than 1.5% of their maximum. The error
+   *        of the recursive blur is then at most about twice this tolerance
+   */
+  bool recursive_gaussian(double& mean_x, double& mean_y, double& sigma_x, double& sigma_y) const
+  {
+    if(!gaussian_sigma(sigma_x, sigma_y))
+      return false;
+
+    moments(kernel_x(), mean_x, sigma_x);
+    moments(kernel_y(), mean_y, sigma_y);
+
+    const double tolerance = 0.015;
+    return gaussian_deviation(kernel_x(), mean_x, sigma_x) <= tolerance &&
+           gaussian_deviation(kernel_y(), mean_y, sigma_y) <= tolerance;
+  }
+
+  /**
+   * @brief updates the kernels reduced by 2^levels
+   */
+  void update_reduced(int levels) const
+  {
+    if(m_reduced_version == m_version && m_reduced_levels == levels)
+      return;
+
+    int factor = 1 << levels;
+    if(is_separable()){
+      reduce(kernel_x(), factor, m_reduced_kernel_x);
+      reduce(kernel_y(), factor, m_reduced_kernel_y);
+    }
+    else
+      reduce(kernel(), factor, m_reduced_kernel);
+
+    m_reduced_version = m_version;
+    m_reduced_levels = levels;
+  }
+
+  /**
+   * @brief reduces a kernel by factor : each tap covers the interval
+   *        [d-1/2, d+1/2] around its offset d from the center, and is spread
+   *        over the taps D of out whose interval [D*factor-factor/2,
+   *        D*factor+factor/2] it overlaps. out applied to an image reduced by
+   *        downsample() thus approximates kernel applied to the full
+   *        resolution image. out has an odd size and the same center
+   *        convention as the convolution (size/2).
+   */
+  static void reduce(const ImageType& kernel, int factor, ImageType& out)
+  {
+    int w = kernel.width() , w_2 = w/2;
+    int h = kernel.height(), h_2 = h/2;
+
+    //tap d goes to tap bin[0] with weight bin[2] and to tap bin[1] with weight
+    //1-bin[2]
+    auto spread = [&](int d, int bin[2], double& weight)
+    {
+      double lo = (d - 0.5)/factor + 0.5;
+      double hi = (d + 0.5)/factor + 0.5;
+      bin[0] = int(std::floor(lo));
+      bin[1] = int(std::ceil(hi)) - 1;
+      weight = bin[0] == bin[1] ? 1. : (bin[0] + 1 - lo)/(hi - lo);
+    };
+
+    int bin[2]; double weight;
+    spread(-w_2, bin, weight);    int r_x = -bin[0];
+    spread(w-1-w_2, bin, weight); r_x = std::max(r_x, bin[1]);
+    spread(-h_2, bin, weight);    int r_y = -bin[0];
+    spread(h-1-h_2, bin, weight); r_y = std::max(r_y, bin[1]);
+
+    out.resize(2*r_y + 1, 2*r_x + 1, kernel.channel());
+    out.data().setZero();
+
+    for(int i=0; i<w; ++i){
+      int bin_x[2]; double weight_x;
+      spread(i - w_2, bin_x, weight_x);
+
+      for(int j=0; j<h; ++j){
+        int bin_y[2]; double weight_y;
+        spread(j - h_2, bin_y, weight_y);
+
+        for(int k=0; k<2; ++k)
+          for(int l=0; l<2; ++l){
+            double weight = (k ? 1. - weight_x : weight_x) * (l ? 1. - weight_y : weight_y);
+            if(weight > 0.)
+              out.data().row((bin_x[k] + r_x)*out.height() + bin_y[l] + r_y) += typename ImageType::Scalar(weight) * kernel.data().row(i*h + j);
+          }
+      }
+    }
+  }
+
 protected:
   ParameterType m_params;
+  unsigned int m_version;
+
+  BlurMode m_blur;
+  int m_levels;
+
+  /* caches *******************************************************************/
+  mutable ImageType m_kernel;
+  mutable ImageType m_kernel_x;
+  mutable ImageType m_kernel_y;
+  mutable unsigned int m_kernel_version;
+  mutable unsigned int m_factors_version;
+
+  mutable FFTConvolution m_fft;
+
+  //pyramid mode and convolve_reduced()
+  mutable FFTConvolution m_reduced_fft;
+  mutable ImageType m_reduced_kernel;
+  mutable ImageType m_reduced_kernel_x;
+  mutable ImageType m_reduced_kernel_y;
+  mutable ImageType m_reduced_in;
+  mutable ImageType m_reduced_out;
+  mutable unsigned int m_reduced_version;
+  mutable int m_reduced_levels;
 };
 
 /* Gaussian psf class ********************************************************/
@@ -53,6 +480,7 @@ protected:
  *          - w : the psf width in pixels
  *          - c : the number of channels
  *          - sigma : the guassian parameters in pixels
+ *        and operator== (see BasePSF::set_model_parameters())
  */
 template <class TImage, class TParam>
 class GaussianPSF : public BasePSF<TImage, TParam>
@@ -78,7 +506,7 @@ public:
     int w = this->m_params.w;
     int c = this->m_params.c;
 
-    psf = ImageType(h, w);
+    psf.resize(h, w, c);
 
     //compute center
     double xc = double(w)/2. - 1.;
@@ -99,8 +527,59 @@ public:
       }
     }
 
+    //normalize psf, each channel sums to one
+    for(int k=0; k<c; ++k)
+      psf.data().col(k) /= psf.data().col(k).sum();
+  }
+
+  virtual bool is_separable() const
+  {
+    return true;
+  }
+
+  virtual bool gaussian_sigma(double& sigma_x, double& sigma_y) const
+  {
+    sigma_x = this->m_params.sigma;
+    sigma_y = this->m_params.sigma;
+    return true;
+  }
+
+  /**
+   * @brief the isotropic gaussian is the product of two 1d gaussians, each
+   *        one is normalized so that their product matches generate()
+   */
+  virtual void generate_separable(ImageType& psf_x, ImageType& psf_y) const
+  {
+    int h = this->m_params.h;
+    int w = this->m_params.w;
+    int c = this->m_params.c;
+
+    psf_x.resize(1, w, c);
+    psf_y.resize(h, 1, c);
+
+    //compute center
+    double xc = double(w)/2. - 1.;
+    double yc = double(h)/2. - 1.;
+
+    //constants
+    double sigma2_sq = 2.*this->m_params.sigma*this->m_params.sigma;
+
+    //compute psf
+    for(int i=0; i<w; ++i){
+      double x = (double(i) - xc);
+      psf_x.set_pixel(i, 0, exp(-(x*x)/sigma2_sq));
+    }
+
+    for(int j=0; j<h; ++j){
+      double y = (double(j) - yc);
+      psf_y.set_pixel(0, j, exp(-(y*y)/sigma2_sq));
+    }
+
     //normalize psf
-    psf.data() /= psf.data().sum();
+    for(int k=0; k<c; ++k){
+      psf_x.data().col(k) /= psf_x.data().col(k).sum();
+      psf_y.data().col(k) /= psf_y.data().col(k).sum();
+    }
   }
 };
 
@@ -0,0 +1,159 @@
+#include "quantized_image.h"
+
+#include <algorithm>
+
+#include "parallel.h"
+
+/* QuantizedImage *************************************************************/
+
+QuantizedImage::QuantizedImage()
+: m_height(0), m_width(0), m_channel(0), m_bits(8)
+{}
+
+QuantizedImage::QuantizedImage(int height, int width, int channel, int bits)
+: m_height(0), m_width(0), m_channel(0), m_bits(8)
+{
+  resize(height, width, channel, bits);
+}
+
+void QuantizedImage::resize(int height, int width, int channel, int bits)
+{
+  m_height  = std::max(height, 0);
+  m_width   = std::max(width, 0);
+  m_channel = std::max(channel, 0);
+  m_bits    = std::min(std::max(bits, 1), 16);
+
+  size_t capacity = m_storage.capacity();
+  m_storage.resize(size_in_bytes());
+  if(m_storage.capacity() != capacity)
+    count_image_allocation(m_storage.capacity());
+}
+
+/* quantization ***************************************************************/
+
+//8x8 Bayer matrix, the thresholds are (value + 0.5)/64
+static const int BAYER[8][8] = { {  0, 32,  8, 40,  2, 34, 10, 42 },
+                                 { 48, 16, 56, 24, 50, 18, 58, 26 },
+                                 { 12, 44,  4, 36, 14, 46,  6, 38 },
+                                 { 60, 28, 52, 20, 62, 30, 54, 22 },
+                                 {  3, 35, 11, 43,  1, 33,  9, 41 },
+                                 { 51, 19, 59, 27, 49, 17, 57, 25 },
+                                 { 15, 47,  7, 39, 13, 45,  5, 37 },
+                                 { 63, 31, 55, 23, 61, 29, 53, 21 } };
+
+//rows processed by a task : the columns of the image and the rows of the
+//quantized image are both read or written sequentially
+static const int ROW_BLOCK = 8;
+
+/**
+ * @brief quantizes the rows [j0, j1) of in, pixel [i, j] going to pixel
+ *        [x+i, y+j] of out, an image of out_width pixels per row
+ */
+template<class TImage, class TValue>
+static void quantize_rows(const TImage& in, int j0, int j1, int max_value, bool dither,
+                          TValue* out, int out_width, int x, int y)
+{
+  typedef typename TImage::Scalar Scalar;
+
+  int h = in.height(), w = in.width(), c = in.channel();
+  Scalar scale = Scalar(max_value);
+
+  for(int i=0; i<w; ++i)
+    for(int j=j0; j<j1; ++j){
+      Scalar offset = dither ? (Scalar(BAYER[(y+j) & 7][(x+i) & 7]) + Scalar(0.5))/Scalar(64) : Scalar(0.5);
+      TValue* value = out + (size_t(y+j)*out_width + x+i)*c;
+
+      for(int k=0; k<c; ++k){
+        //clamped to [0, 1], nan to 0
+        Scalar v = in.data()(i*h + j, k);
+        v = v > Scalar(0) ? std::min(v, Scalar(1)) : Scalar(0);
+
+        value[k] = TValue(v*scale + offset);
+      }
+    }
+}
+
+template<class TImage, class TValue>
+static void quantize_values(const TImage& in, int max_value, bool dither, TValue* out)
+{
+  int h = in.height();
+
+  parallel_for((h + ROW_BLOCK - 1)/ROW_BLOCK, [&](int block)
+  {
+    int j0 = block*ROW_BLOCK, j1 = std::min(h, j0 + ROW_BLOCK);
+    quantize_rows(in, j0, j1, max_value, dither, out, in.width(), 0, 0);
+  });
+}
+
+template<class TImage, class TValue>
+static void dequantize_values(const TValue* in, int max_value, TImage& out)
+{
+  typedef typename TImage::Scalar Scalar;
+
+  int h = out.height(), w = out.width(), c = out.channel();
+  Scalar scale = Scalar(1)/Scalar(max_value);
+
+  parallel_for((h + ROW_BLOCK - 1)/ROW_BLOCK, [&](int block)
+  {
+    int j0 = block*ROW_BLOCK, j1 = std::min(h, j0 + ROW_BLOCK);
+
+    for(int i=0; i<w; ++i)
+      for(int j=j0; j<j1; ++j){
+        const TValue* value = in + (size_t(j)*w + i)*c;
+        for(int k=0; k<c; ++k)
+          out.data()(i*h + j, k) = Scalar(value[k])*scale;
+      }
+  });
+}
+
+template<class TImage>
+void quantize(const TImage& in, int bits, bool dither, QuantizedImage& out)
+{
+  out.resize(in.height(), in.width(), in.channel(), bits);
+
+  if(out.bytes_per_value() == 1)
+    quantize_values(in, out.max_value(), dither, out.data8());
+  else
+    quantize_values(in, out.max_value(), dither, out.data16());
+}
+
+template<class TImage>
+void quantize_tile(const TImage& in, bool dither, int x, int y, QuantizedImage& out)
+{
+  int h = in.height();
+
+  for(int j0=0; j0<h; j0+=ROW_BLOCK){
+    int j1 = std::min(h, j0 + ROW_BLOCK);
+    if(out.bytes_per_value() == 1)
+      quantize_rows(in, j0, j1, out.max_value(), dither, out.data8(), out.width(), x, y);
+    else
+      quantize_rows(in, j0, j1, out.max_value(), dither, out.data16(), out.width(), x, y);
+  }
+}
+
+template<class TImage>
+void dequantize(const QuantizedImage& in, TImage& out)
+{
+  out.resize(in.height(), in.width(), in.channel());
+
+  if(in.bytes_per_value() == 1)
+    dequantize_values(in.data8(), in.max_value(), out);
+  else
+    dequantize_values(in.data16(), in.max_value(), out);
+}
+
+/* explicit instantiations ****************************************************/
+template void quantize(const ImageT<double, PLANAR     >&, int, bool, QuantizedImage&);
+template void quantize(const ImageT<double, INTERLEAVED>&, int, bool, QuantizedImage&);
+template void quantize(const ImageT<float , PLANAR     >&, int, bool, QuantizedImage&);
+template void quantize(const ImageT<float , INTERLEAVED>&, int, bool, QuantizedImage&);
+
+template void quantize_tile(const ImageT<double, PLANAR     >&, bool, int, int, QuantizedImage&);
+template void quantize_tile(const ImageT<double, INTERLEAVED>&, bool, int, int, QuantizedImage&);
+template void quantize_tile(const ImageT<float , PLANAR     >&, bool, int, int, QuantizedImage&);
+template void quantize_tile(const ImageT<float , INTERLEAVED>&, bool, int, int, QuantizedImage&);
+
+template void dequantize(const QuantizedImage&, ImageT<double, PLANAR     >&);
+template void dequantize(const QuantizedImage&, ImageT<double, INTERLEAVED>&);
+template void dequantize(const QuantizedImage&, ImageT<float , PLANAR     >&);
+template void dequantize(const QuantizedImage&, ImageT<float , INTERLEAVED>&);
@@ -0,0 +1,146 @@
+#ifndef QUANTIZED_IMAGE_H
+#define QUANTIZED_IMAGE_H
+
+#include <stdint.h>
+#include <vector>
+
+#include "image.h"
+
+/**
+ * @brief an image of integer values in [0, 2^bits-1], for bits in [1, 16],
+ *        as sent to a display or saved in a file : 1 byte per value up to 8
+ *        bits, 2 bytes (native byte order) above.
+ *        The values are interleaved and stored row by row (channel, then x,
+ *        then y), the layout of most file formats.
+ *        As for ImageT, resize() only reallocates the memory when it is too
+ *        small, so that buffers are reused from one frame to the next.
+ */
+class QuantizedImage
+{
+public:
+  QuantizedImage();
+  QuantizedImage(int height, int width, int channel, int bits);
+
+  /**
+   * @brief changes the size and the number of bits, the values are
+   *        unspecified
+   */
+  void resize(int height, int width, int channel, int bits);
+
+  inline int height() const
+  {
+    return m_height;
+  }
+
+  inline int width() const
+  {
+    return m_width;
+  }
+
+  inline int channel() const
+  {
+    return m_channel;
+  }
+
+  inline int bits() const
+  {
+    return m_bits;
+  }
+
+  inline int max_value() const
+  {
+    return (1 << m_bits) - 1;
+  }
+
+  inline bool is_valid() const
+  {
+    return m_height > 0 && m_width > 0 && m_channel > 0;
+  }
+
+  /**
+   * @brief 1 or 2
+   */
+  inline int bytes_per_value() const
+  {
+    return m_bits > 8 ? 2 : 1;
+  }
+
+  /**
+   * @brief index of the value of channel c of pixel [i,j] (x = i, y = j)
+   */
+  inline size_t index(int i, int j, int c) const
+  {
+    return (size_t(j)*m_width + i)*m_channel + c;
+  }
+
+  /**
+   * @brief the values, data8() if bits <= 8 and data16() otherwise
+   */
+  inline uint8_t* data8()
+  {
+    return m_storage.data();
+  }
+
+  inline const uint8_t* data8() const
+  {
+    return m_storage.data();
+  }
+
+  inline uint16_t* data16()
+  {
+    return reinterpret_cast<uint16_t*>(m_storage.data());
+  }
+
+  inline const uint16_t* data16() const
+  {
+    return reinterpret_cast<const uint16_t*>(m_storage.data());
+  }
+
+  /**
+   * @brief size of the values in bytes
+   */
+  inline size_t size_in_bytes() const
+  {
+    return size_t(m_height)*m_width*m_channel*bytes_per_value();
+  }
+
+private:
+  int m_height;
+  int m_width;
+  int m_channel;
+  int m_bits;
+
+  std::vector<uint8_t> m_storage;
+};
+
+/**
+ * @brief quantizes the values of in, which are clamped to [0, 1], to
+ *        round(value*(2^bits-1)).
+ * @param dither replaces the rounding by an ordered dither (8x8 Bayer
+ *        matrix) : each value is rounded up with a probability equal to its
+ *        fractional part, so that the mean of a region keeps the precision
+ *        lost by the quantization. The pattern is fixed, so static images
+ *        do not flicker.
+ *        Implemented for the image types of image.h.
+ */
+template<class TImage>
+void quantize(const TImage& in, int bits, bool dither, QuantizedImage& out);
+
+/**
+ * @brief quantize() applied to the pixels [x, x+in.width()) x
+ *        [y, y+in.height()) of out, which must contain them and have the
+ *        channels and bits of the result. The dither pattern is the one of
+ *        out, so that an image quantized tile by tile gives the same values
+ *        as quantize(). Runs on the calling thread, e.g. in the tasks of a
+ *        parallel_for() processing the tiles of out.
+ */
+template<class TImage>
+void quantize_tile(const TImage& in, bool dither, int x, int y, QuantizedImage& out);
+
+/**
+ * @brief inverse of quantize() : out receives the values divided by 2^bits-1
+ */
+template<class TImage>
+void dequantize(const QuantizedImage& in, TImage& out);
+
+#endif //QUANTIZED_IMAGE_H